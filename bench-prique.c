@@ -0,0 +1,120 @@
+#include "prique.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define COUNT 10000
+#define PRIORITIES 10
+#define EXPIRE 60
+#define NAME "bench-prique"
+#define REDIS_CONNECT_TIMEOUT {1, 500000}
+
+static long long ustime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void report(const char *backend, const char *op, int n, long long us)
+{
+    printf("%-7s %-5s %8d ops %10.3f ms %10.0f ops/sec %8.2f us/op\n",
+        backend, op, n, us / 1000.0, us > 0 ? n * 1e6 / us : 0.0, n > 0 ? (double)us / n : 0.0);
+}
+
+/* Pushes count items spread over priorities levels, then pops them all. The
+ * payload size is fixed so only the queue bookkeeping differs between runs. */
+static int bench(redisContext *c,
+    const char *backend,
+    const char *enqueue_sha1,
+    const char *dequeue_sha1,
+    const char *name,
+    int count,
+    int priorities)
+{
+    long long start;
+    int i, rv, popped = 0;
+
+    srand(1);
+    start = ustime();
+    for (i = 0; i < count; i++) {
+        char msg[32];
+
+        snprintf(msg, sizeof(msg), "msg-%010d", i);
+        rv = prique_push(c, enqueue_sha1, NULL, name, rand() % priorities, EXPIRE, (unsigned char *)msg, strlen(msg));
+        if (rv) {
+            fprintf(stderr, "%s: prique_push failed: %s\n", backend, c->err ? c->errstr : "bad reply");
+            return -1;
+        }
+    }
+    report(backend, "push", count, ustime() - start);
+
+    start = ustime();
+    for (i = 0; i < count; i++) {
+        unsigned char *msg = NULL;
+        size_t msgsize = 0;
+
+        rv = prique_pop(c, dequeue_sha1, NULL, name, &msg, &msgsize);
+        if (rv) {
+            fprintf(stderr, "%s: prique_pop failed: %s\n", backend, c->errstr);
+            return -1;
+        }
+        if (msgsize > 0)
+            popped++;
+        free(msg);
+    }
+    report(backend, "pop", popped, ustime() - start);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct timeval timeout = REDIS_CONNECT_TIMEOUT;
+    redisContext *c;
+    redisReply *reply;
+    int count = COUNT, priorities = PRIORITIES;
+
+    if (argc < 5 || argc > 7) {
+        fprintf(stderr, "Usage: %s <Redis addr> <Redis port> <enqueue.lua sha1> <dequeue.lua sha1> [count] [priorities]\n", argv[0]);
+        return 0;
+    }
+    if (argc > 5)
+        count = atoi(argv[5]);
+    if (argc > 6)
+        priorities = atoi(argv[6]);
+    if (count <= 0 || priorities <= 0) {
+        fprintf(stderr, "count and priorities must be positive\n");
+        return -1;
+    }
+
+    c = redisConnectWithTimeout(argv[1], atoi(argv[2]), timeout);
+    if (c == NULL || c->err)
+        return -1;
+
+    printf("%d items, %d priorities\n", count, priorities);
+
+    prique_set_backend(PRIQUE_BACKEND_SCRIPT);
+    if (bench(c, "script", argv[3], argv[4], NAME ":script", count, priorities) == 0) {
+        /* the sync pop never drains the signal list */
+        reply = redisCommand(c, "DEL %s %s", NAME ":script", NAME ":script:cnt");
+        if (reply)
+            freeReplyObject(reply);
+    }
+
+    reply = redisCommand(c, "PQ.LEN %s", NAME ":module");
+    if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        printf("module  skipped, priquemodule.so not loaded\n");
+    } else {
+        prique_set_backend(PRIQUE_BACKEND_MODULE);
+        bench(c, "module", NULL, NULL, NAME ":module", count, priorities);
+    }
+    if (reply)
+        freeReplyObject(reply);
+
+    redisFree(c);
+
+    return 0;
+}
@@ -1,28 +1,110 @@
 local priqueue_prefix = ARGV[1];
 local priority_set = priqueue_prefix .. ':priset';
-local key = priqueue_prefix .. ':i';
+local weights = priqueue_prefix .. ':weights';
+local cursor = priqueue_prefix .. ':drr';
+local dedup = priqueue_prefix .. ':dedup';
+local dedup_rev = priqueue_prefix .. ':dedupkey';
 local rv;
 
-rv = redis.call('ZREVRANGE', priority_set, 0, -1);
-for i = 1, #rv do
-    local priority = rv[i];
+-- an item pushed with a dedup key is no longer pending once popped
+local function forget(cnt)
+    local dedup_key = redis.call('HGET', dedup_rev, cnt);
+    if dedup_key ~= false then
+        redis.call('HDEL', dedup_rev, cnt);
+        local pending = redis.call('HGET', dedup, dedup_key);
+        if pending ~= false and string.match(pending, '^(%d+):') == cnt then
+            redis.call('HDEL', dedup, dedup_key);
+        end
+    end
+end
+
+-- pops the oldest live item of one priority level; the second result tells
+-- whether the level is now empty (and removed from priority_set)
+local function pop_priority(priority)
     local priority_queue = priqueue_prefix .. ':' .. priority;
-    local cnt = true;
+    local cnt = redis.call('RPOP', priority_queue);
     while cnt ~= false do
-        cnt = redis.call('RPOP', priority_queue);
-        if cnt ~= false then
-            key = key .. ':' .. cnt;
-            local value = redis.call('GET', key);
-            if value ~= false then
-                local len = redis.call('LLEN', priority_queue);
-                if len <= 0 then
-                    redis.call('ZREM', priority_set, priority);
-                end
-                return value;
+        local value = redis.call('GET', priqueue_prefix .. ':i:' .. cnt);
+        forget(cnt);
+        if value ~= false then
+            local len = redis.call('LLEN', priority_queue);
+            if len <= 0 then
+                redis.call('ZREM', priority_set, priority);
             end
+            return value, len <= 0;
         end
+        cnt = redis.call('RPOP', priority_queue);
     end
     redis.call('ZREM', priority_set, priority);
+    return false, true;
+end
+
+local function weight(priority)
+    local w = tonumber(redis.call('HGET', weights, priority));
+    if w == nil or w < 1 then
+        return 1;
+    end
+    return w;
+end
+
+rv = redis.call('ZREVRANGE', priority_set, 0, -1);
+
+-- no weights: strict priority, drain the highest level first
+if redis.call('EXISTS', weights) == 0 then
+    for i = 1, #rv do
+        local value = pop_priority(rv[i]);
+        if value ~= false then
+            return value;
+        end
+    end
+    return nil;
+end
+
+-- weights: deficit round robin over the levels, highest first. Each level
+-- may dequeue up to its weight items per round; the level being served and
+-- its remaining deficit persist in priqueue:drr between calls.
+if #rv == 0 then
+    return nil;
+end
+local state = redis.call('HMGET', cursor, 'cur', 'deficit');
+local cur = tonumber(state[1]);
+local deficit = tonumber(state[2]) or 0;
+local i = nil;
+if cur ~= nil then
+    for j = 1, #rv do
+        local priority = tonumber(rv[j]);
+        if priority == cur then
+            i = j;
+            break;
+        elseif priority < cur then
+            -- the level we were serving is gone, continue with the next lower
+            i = j;
+            deficit = weight(rv[j]);
+            break;
+        end
+    end
+end
+if i == nil then
+    i = 1;
+    deficit = weight(rv[1]);
+end
+
+for n = 1, 2 * #rv do
+    if deficit < 1 then
+        i = i % #rv + 1;
+        deficit = weight(rv[i]);
+    end
+    local value, drained = pop_priority(rv[i]);
+    if value ~= false then
+        deficit = deficit - 1;
+        if drained then
+            deficit = 0;
+        end
+        redis.call('HMSET', cursor, 'cur', rv[i], 'deficit', deficit);
+        return value;
+    end
+    deficit = 0;
 end
+redis.call('DEL', cursor);
 
 return nil;
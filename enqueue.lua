@@ -2,20 +2,49 @@ local priqueue_prefix = ARGV[1];
 local priority = ARGV[2];
 local expire = ARGV[3];
 local value = ARGV[4];
+local dedup_key = ARGV[5];
 local counter = priqueue_prefix .. ':cnt';
 local key = priqueue_prefix .. ':i';
 local priority_queue = priqueue_prefix .. ':' .. priority;
 local priority_set = priqueue_prefix .. ':priset';
 local signal_queue = priqueue_prefix;
+local dedup = priqueue_prefix .. ':dedup';
+local dedup_rev = priqueue_prefix .. ':dedupkey';
+local coalesced = priqueue_prefix .. ':coalesced';
 local rv, cnt;
 
+local function set_value(k)
+    if tonumber(expire) > 0 then
+        return redis.call('SETEX', k, expire, value);
+    else
+        return redis.call('SET', k, value);
+    end
+end
+
+-- an item with the same dedup key still pending: update it in place,
+-- keeping the higher priority, and count the push as coalesced
+if dedup_key ~= nil and dedup_key ~= '' then
+    local pending = redis.call('HGET', dedup, dedup_key);
+    if pending ~= false then
+        local old_cnt, old_priority = string.match(pending, '^(%d+):(.*)$');
+        local item = key .. ':' .. old_cnt;
+        if redis.call('EXISTS', item) == 1 then
+            set_value(item);
+            if tonumber(priority) > tonumber(old_priority) then
+                redis.call('LREM', priqueue_prefix .. ':' .. old_priority, 1, old_cnt);
+                redis.call('LPUSH', priority_queue, old_cnt);
+                redis.call('ZADD', priority_set, priority, priority);
+                redis.call('HSET', dedup, dedup_key, old_cnt .. ':' .. priority);
+            end
+            redis.call('INCR', coalesced);
+            return 2;
+        end
+    end
+end
+
 cnt = redis.call('INCR', counter);
 key = key .. ':' .. cnt;
-if tonumber(expire) > 0 then
-    rv = redis.call('SETEX', key, expire, value);
-else
-    rv = redis.call('SET', key, value);
-end
+rv = set_value(key);
 
 rv = redis.call('LPUSH', priority_queue, cnt);
 if rv <= 0 then
@@ -28,4 +57,9 @@ if rv <= 0 then
     return redis.error_reply('LPUSH ' .. signal_queue .. ' failed');
 end
 
+if dedup_key ~= nil and dedup_key ~= '' then
+    redis.call('HSET', dedup, dedup_key, cnt .. ':' .. priority);
+    redis.call('HSET', dedup_rev, cnt, dedup_key);
+end
+
 return 1;
@@ -0,0 +1,45 @@
+#include "rwlock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define RESOURCE "test2"
+#define TTL (60 * 1000)
+#define TIMEOUT (5 * 1000)
+#define SLEEP_US (10 * 1000 * 1000)
+
+int main(int argc, char **argv) {
+    rwlock_server servers[] = { { "127.0.0.1", 6379 }, { "127.0.0.1", 6380 } };
+    char token[RWLOCK_TOKEN_SIZE];
+    rwlock *l;
+    int rv;
+
+    l = rwlock_new(servers, sizeof(servers) / sizeof(servers[0]), 5 * 1000);
+    if (l == NULL)
+        return -1;
+
+    rv = rwlock_rlock(l, RESOURCE, TTL, TIMEOUT);
+    if (rv == 0)
+        printf("rlock success\n");
+    else {
+        printf("rlock failed\n");
+        return -1;
+    }
+    usleep(SLEEP_US);
+    rwlock_unlock(l, RESOURCE, NULL);
+
+    rv = rwlock_wlock(l, RESOURCE, TTL, TIMEOUT, token);
+    if (rv == 0)
+        printf("wlock success: %s\n", token);
+    else {
+        printf("wlock failed\n");
+        return -1;
+    }
+    usleep(SLEEP_US);
+    rwlock_unlock(l, RESOURCE, token);
+
+    rwlock_free(l);
+
+    return 0;
+}
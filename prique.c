@@ -25,14 +25,28 @@ static int execute_commandv(redisContext *c,
     redisReply **reply,
     const char *name,
     va_list ap);
+static int execute_module_commandv(redisContext *c,
+    int op,
+    redisReply **reply,
+    const char *name,
+    va_list ap);
 
 enum {
     PUSH = 0,
+    PUSH_DEDUP,
     POP,
     BPOP,
-    OTHER,
+    LEN,
+    REMOVE,
 };
 
+static int backend_ = PRIQUE_DEFAULT_BACKEND;
+
+void prique_set_backend(int backend)
+{
+    backend_ = backend;
+}
+
 int prique_push(redisContext *c,
     const char *enqueue_sha1,
     const char *enqueue_path,
@@ -59,6 +73,54 @@ int prique_push(redisContext *c,
     return rv;
 }
 
+int prique_push_dedup(redisContext *c,
+    const char *enqueue_sha1,
+    const char *enqueue_path,
+    const char *name,
+    const char *dedup_key,
+    unsigned int priority,
+    unsigned int expire,
+    const unsigned char *val,
+    size_t val_size)
+{
+    redisReply *reply = NULL;
+    int rv;
+
+    if (dedup_key == NULL || dedup_key[0] == '\0')
+        return prique_push(c, enqueue_sha1, enqueue_path, name, priority, expire, val, val_size);
+    if (backend_ == PRIQUE_BACKEND_MODULE)
+        return -1;
+    rv = execute_command(c, PUSH_DEDUP, enqueue_sha1, enqueue_path, &reply, name, priority, expire, val, val_size, dedup_key);
+    if (rv)
+        return rv;
+    if (reply->type == REDIS_REPLY_INTEGER
+        && (reply->integer == 1 || reply->integer == 2))
+        rv = (int)reply->integer - 1;
+    else
+        rv = -1;
+    if (reply)
+        freeReplyObject(reply);
+
+    return rv;
+}
+
+long long prique_coalesced(redisContext *c, const char *name)
+{
+    redisReply *reply;
+    long long rv = 0;
+
+    reply = (redisReply *)redisCommand(c, "GET %s:coalesced", name);
+    if (c->err != REDIS_OK)
+        return -1;
+    if (reply->type == REDIS_REPLY_STRING)
+        rv = strtoll(reply->str, NULL, 10);
+    else if (reply->type != REDIS_REPLY_NIL)
+        rv = -1;
+    freeReplyObject(reply);
+
+    return rv;
+}
+
 int prique_pop(redisContext *c,
     const char *dequeue_sha1,
     const char *dequeue_path,
@@ -114,7 +176,7 @@ int prique_len(redisContext *c,
     redisReply *reply = NULL;
     int rv;
 
-    rv = execute_command(c, OTHER, lenqueue_sha1, lenqueue_path, &reply, name);
+    rv = execute_command(c, LEN, lenqueue_sha1, lenqueue_path, &reply, name);
     if (rv)
         return rv;
     rv = reply->integer;
@@ -132,7 +194,7 @@ int prique_remove(redisContext *c,
     redisReply *reply = NULL;
     int rv;
 
-    rv = execute_command(c, OTHER, rmqueue_sha1, rmqueue_path, &reply, name);
+    rv = execute_command(c, REMOVE, rmqueue_sha1, rmqueue_path, &reply, name);
     if (rv)
         return rv;
     rv = reply->integer;
@@ -142,6 +204,31 @@ int prique_remove(redisContext *c,
     return rv;
 }
 
+int prique_set_weight(redisContext *c,
+    const char *name,
+    unsigned int priority,
+    unsigned int weight)
+{
+    redisReply *reply;
+    char weights[128];
+    int rv = 0;
+
+    if (backend_ == PRIQUE_BACKEND_MODULE)
+        return -1;
+    snprintf(weights, sizeof(weights), "%s:weights", name);
+    if (weight > 0)
+        reply = (redisReply *)redisCommand(c, "HSET %s %u %u", weights, priority, weight);
+    else
+        reply = (redisReply *)redisCommand(c, "HDEL %s %u", weights, priority);
+    if (c->err != REDIS_OK)
+        return -1;
+    if (reply->type == REDIS_REPLY_ERROR)
+        rv = -1;
+    freeReplyObject(reply);
+
+    return rv;
+}
+
 static int load_script(const char *script_file, char **script, size_t *scriptsize)
 {
     size_t filesize;
@@ -216,8 +303,11 @@ static int execute_commandv(redisContext *c,
     unsigned int priority, expire, timeout;
     unsigned char *val;
     size_t val_size;
+    const char *dedup_key;
     va_list cpy;
-    
+
+    if (backend_ == PRIQUE_BACKEND_MODULE)
+        return execute_module_commandv(c, op, reply, name, ap);
     assert(sha1 || path);
     if (!sha1) {
         rv = load_script(path, &script, &scriptsize);
@@ -238,6 +328,18 @@ static int execute_commandv(redisContext *c,
             *reply = (redisReply *)redisCommand(c, "EVAL %s 0 %s %u %u %b", script, name, priority, expire, val, val_size);
         break;
 
+    case PUSH_DEDUP:
+        priority = va_arg(ap, unsigned int);
+        expire = va_arg(ap, unsigned int);
+        val = va_arg(ap, unsigned char *);
+        val_size = va_arg(ap, size_t);
+        dedup_key = va_arg(ap, const char *);
+        if (sha1)
+            *reply = (redisReply *)redisCommand(c, "EVALSHA %s 0 %s %u %u %b %s", sha1, name, priority, expire, val, val_size, dedup_key);
+        else
+            *reply = (redisReply *)redisCommand(c, "EVAL %s 0 %s %u %u %b %s", script, name, priority, expire, val, val_size, dedup_key);
+        break;
+
     case BPOP:
         timeout = va_arg(ap, unsigned int);
     case POP:
@@ -264,3 +366,48 @@ static int execute_commandv(redisContext *c,
 
     return 0;
 }
+
+static int execute_module_commandv(redisContext *c,
+    int op,
+    redisReply **reply,
+    const char *name,
+    va_list ap)
+{
+    unsigned int priority, expire, timeout;
+    unsigned char *val;
+    size_t val_size;
+
+    switch (op) {
+    case PUSH:
+        priority = va_arg(ap, unsigned int);
+        expire = va_arg(ap, unsigned int);
+        val = va_arg(ap, unsigned char *);
+        val_size = va_arg(ap, size_t);
+        *reply = (redisReply *)redisCommand(c, "PQ.PUSH %s %u %u %b", name, priority, expire, val, val_size);
+        break;
+
+    case BPOP:
+        timeout = va_arg(ap, unsigned int);
+        *reply = (redisReply *)redisCommand(c, "PQ.BPOP %s %u", name, timeout);
+        break;
+
+    case POP:
+        *reply = (redisReply *)redisCommand(c, "PQ.POP %s", name);
+        break;
+
+    case LEN:
+        *reply = (redisReply *)redisCommand(c, "PQ.LEN %s", name);
+        break;
+
+    case REMOVE:
+        *reply = (redisReply *)redisCommand(c, "DEL %s", name);
+        break;
+
+    default:
+        return -1;
+    }
+    if (c->err != REDIS_OK)
+        return -1;
+
+    return 0;
+}
@@ -3,6 +3,19 @@
 
 #include "hiredis/hiredis.h"
 
+/* Backends for prique_set_backend(). PRIQUE_BACKEND_MODULE talks to
+ * priquemodule.so with PQ.* commands and ignores the *_sha1 / *_path
+ * arguments. Both backends must not be used on the same queue name. */
+#define PRIQUE_BACKEND_SCRIPT 0
+#define PRIQUE_BACKEND_MODULE 1
+
+#ifndef PRIQUE_DEFAULT_BACKEND
+#define PRIQUE_DEFAULT_BACKEND PRIQUE_BACKEND_SCRIPT
+#endif
+
+/* Process-wide; defaults to PRIQUE_DEFAULT_BACKEND. */
+void prique_set_backend(int backend);
+
 int prique_push(redisContext *c, 
     const char *enqueue_sha1,
     const char *enqueue_path,
@@ -12,6 +25,26 @@ int prique_push(redisContext *c,
     const unsigned char *val, 
     size_t valsize);
 
+/* Like prique_push, but while an item pushed with the same dedup_key is
+ * still pending, that item is updated in place instead: its payload (and
+ * expiry) is replaced and its priority raised to priority if higher.
+ * Returns 0 when a new item was queued, 1 when the push was coalesced,
+ * -1 on error. Script backend only. enqueue.lua replies 2 for a coalesced
+ * push, which only happens when it is given a dedup key, so prique_push()
+ * keeps expecting 1. */
+int prique_push_dedup(redisContext *c,
+    const char *enqueue_sha1,
+    const char *enqueue_path,
+    const char *name,
+    const char *dedup_key,
+    unsigned int priority,
+    unsigned int expire,
+    const unsigned char *val,
+    size_t valsize);
+
+/* Number of coalesced pushes since the queue was created, -1 on error. */
+long long prique_coalesced(redisContext *c, const char *name);
+
 int prique_pop(redisContext *c,
     const char *dequeue_sha1,
     const char *dequeue_path,
@@ -37,4 +70,14 @@ int prique_remove(redisContext *c,
     const char *rmqueue_path,
     const char *name);
 
+/* Weighted-fair dequeue. Once a queue has weights, dequeue.lua serves its
+ * priority levels by deficit round robin, each level taking up to weight
+ * items per round (levels without a weight take 1), instead of draining the
+ * highest level first. weight 0 drops the level's weight; with no weights
+ * left the queue is strict priority again. Script backend only. */
+int prique_set_weight(redisContext *c,
+    const char *name,
+    unsigned int priority,
+    unsigned int weight);
+
 #endif /* __PRIQUE_H__ */
@@ -0,0 +1,513 @@
+/* Native priority queue type for Redis, loaded with
+ *
+ *     MODULE LOAD /path/to/priquemodule.so
+ *
+ * Same semantics as the enqueue/dequeue scripts: higher priority first,
+ * FIFO within a priority, optional per-item expiry (expired items are
+ * dropped when they reach the head), blocking pop. Each queue is a single
+ * key holding a binary heap ordered by (priority desc, insertion seq asc).
+ *
+ * PQ.PUSH <key> <priority> <expire> <value>    -> 1
+ * PQ.POP <key>                                 -> value | nil
+ * PQ.BPOP <key> <timeout>                      -> value | nil on timeout
+ * PQ.LEN <key>                                 -> number of items
+ *
+ * PQ.PUSHAT and PQ.DISCARD are what PQ.PUSH/PQ.POP replicate as (and what
+ * AOF rewrite emits) so replicas never evaluate expiry on their own clock.
+ */
+#include "redismodule.h"
+
+#include <string.h>
+
+#define PQ_TYPE_NAME "priquemod"
+#define PQ_ENCVER 0
+#define PQ_INIT_CAP 16
+
+struct pq_item {
+    long long priority;
+    unsigned long long seq;
+    long long expire_at;    /* unix time in ms, 0 means never */
+    size_t len;
+    char *val;
+};
+
+struct priqueue {
+    struct pq_item **heap;
+    size_t len;
+    size_t cap;
+    size_t bytes;
+    unsigned long long seq;
+};
+
+static RedisModuleType *PriqueType;
+
+static struct priqueue *pq_new(void);
+static void pq_free(void *value);
+static int pq_push(struct priqueue *pq, long long priority, unsigned long long seq, long long expire_at, const char *val, size_t len);
+static struct pq_item *pq_take(struct priqueue *pq);
+static struct pq_item *pq_pop(struct priqueue *pq, long long now, long long *taken);
+static void pq_item_free(struct pq_item *item);
+static int pq_before(const struct pq_item *a, const struct pq_item *b);
+static void pq_sift_up(struct priqueue *pq, size_t i);
+static void pq_sift_down(struct priqueue *pq, size_t i);
+static int open_queue(RedisModuleCtx *ctx, RedisModuleString *name, int mode, RedisModuleKey **key, struct priqueue **pq);
+static int pop_reply(RedisModuleCtx *ctx, RedisModuleString *name);
+
+static struct priqueue *pq_new(void)
+{
+    struct priqueue *pq;
+
+    pq = RedisModule_Alloc(sizeof(*pq));
+    pq->heap = RedisModule_Alloc(sizeof(struct pq_item *) * PQ_INIT_CAP);
+    pq->len = 0;
+    pq->cap = PQ_INIT_CAP;
+    pq->bytes = 0;
+    pq->seq = 0;
+
+    return pq;
+}
+
+static void pq_free(void *value)
+{
+    struct priqueue *pq = value;
+    size_t i;
+
+    for (i = 0; i < pq->len; i++)
+        pq_item_free(pq->heap[i]);
+    RedisModule_Free(pq->heap);
+    RedisModule_Free(pq);
+}
+
+static void pq_item_free(struct pq_item *item)
+{
+    RedisModule_Free(item->val);
+    RedisModule_Free(item);
+}
+
+static int pq_before(const struct pq_item *a, const struct pq_item *b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    return a->seq < b->seq;
+}
+
+static void pq_sift_up(struct priqueue *pq, size_t i)
+{
+    struct pq_item *item = pq->heap[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if (!pq_before(item, pq->heap[parent]))
+            break;
+        pq->heap[i] = pq->heap[parent];
+        i = parent;
+    }
+    pq->heap[i] = item;
+}
+
+static void pq_sift_down(struct priqueue *pq, size_t i)
+{
+    struct pq_item *item = pq->heap[i];
+
+    for (;;) {
+        size_t child = 2 * i + 1;
+
+        if (child >= pq->len)
+            break;
+        if (child + 1 < pq->len && pq_before(pq->heap[child + 1], pq->heap[child]))
+            child++;
+        if (!pq_before(pq->heap[child], item))
+            break;
+        pq->heap[i] = pq->heap[child];
+        i = child;
+    }
+    pq->heap[i] = item;
+}
+
+/* seq is passed in rather than taken from pq->seq so RDB load and
+ * PQ.PUSHAT reproduce the exact order of the master. */
+static int pq_push(struct priqueue *pq,
+    long long priority,
+    unsigned long long seq,
+    long long expire_at,
+    const char *val,
+    size_t len)
+{
+    struct pq_item *item;
+
+    if (pq->len == pq->cap) {
+        pq->cap *= 2;
+        pq->heap = RedisModule_Realloc(pq->heap, sizeof(struct pq_item *) * pq->cap);
+    }
+    item = RedisModule_Alloc(sizeof(*item));
+    item->priority = priority;
+    item->seq = seq;
+    item->expire_at = expire_at;
+    item->len = len;
+    item->val = RedisModule_Alloc(len > 0 ? len : 1);
+    memcpy(item->val, val, len);
+    if (seq >= pq->seq)
+        pq->seq = seq + 1;
+    pq->bytes += len;
+    pq->heap[pq->len++] = item;
+    pq_sift_up(pq, pq->len - 1);
+
+    return 0;
+}
+
+/* Removes the head regardless of expiry. */
+static struct pq_item *pq_take(struct priqueue *pq)
+{
+    struct pq_item *item;
+
+    if (pq->len == 0)
+        return NULL;
+    item = pq->heap[0];
+    pq->bytes -= item->len;
+    if (--pq->len > 0) {
+        pq->heap[0] = pq->heap[pq->len];
+        pq_sift_down(pq, 0);
+    }
+
+    return item;
+}
+
+/* Returns the first live item, dropping expired ones on the way. *taken is
+ * the number of heads removed, the returned one included. */
+static struct pq_item *pq_pop(struct priqueue *pq, long long now, long long *taken)
+{
+    struct pq_item *item;
+
+    *taken = 0;
+    while ((item = pq_take(pq)) != NULL) {
+        (*taken)++;
+        if (item->expire_at == 0 || item->expire_at > now)
+            return item;
+        pq_item_free(item);
+    }
+
+    return NULL;
+}
+
+static void *pq_rdb_load(RedisModuleIO *rdb, int encver)
+{
+    struct priqueue *pq;
+    uint64_t n, i;
+
+    if (encver != PQ_ENCVER) {
+        RedisModule_LogIOError(rdb, "warning", "Can't load priquemod encver %d", encver);
+        return NULL;
+    }
+    pq = pq_new();
+    n = RedisModule_LoadUnsigned(rdb);
+    for (i = 0; i < n; i++) {
+        long long priority = RedisModule_LoadSigned(rdb);
+        unsigned long long seq = RedisModule_LoadUnsigned(rdb);
+        long long expire_at = RedisModule_LoadSigned(rdb);
+        size_t len;
+        char *val = RedisModule_LoadStringBuffer(rdb, &len);
+
+        pq_push(pq, priority, seq, expire_at, val, len);
+        RedisModule_Free(val);
+    }
+
+    return pq;
+}
+
+static void pq_rdb_save(RedisModuleIO *rdb, void *value)
+{
+    struct priqueue *pq = value;
+    size_t i;
+
+    RedisModule_SaveUnsigned(rdb, pq->len);
+    for (i = 0; i < pq->len; i++) {
+        struct pq_item *item = pq->heap[i];
+
+        RedisModule_SaveSigned(rdb, item->priority);
+        RedisModule_SaveUnsigned(rdb, item->seq);
+        RedisModule_SaveSigned(rdb, item->expire_at);
+        RedisModule_SaveStringBuffer(rdb, item->val, item->len);
+    }
+}
+
+/* Heap order is irrelevant here: PQ.PUSHAT reinserts each item under its own
+ * seq, so replay rebuilds the same queue. */
+static void pq_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
+{
+    struct priqueue *pq = value;
+    size_t i;
+
+    for (i = 0; i < pq->len; i++) {
+        struct pq_item *item = pq->heap[i];
+
+        RedisModule_EmitAOF(aof, "PQ.PUSHAT", "slllb", key, item->priority, (long long)item->seq, item->expire_at, item->val, item->len);
+    }
+}
+
+static size_t pq_mem_usage(const void *value)
+{
+    const struct priqueue *pq = value;
+
+    return sizeof(*pq) + pq->cap * sizeof(struct pq_item *)
+        + pq->len * sizeof(struct pq_item) + pq->bytes;
+}
+
+/* Returns REDISMODULE_OK with *pq set (NULL if the key is empty), or
+ * REDISMODULE_ERR after replying WRONGTYPE. */
+static int open_queue(RedisModuleCtx *ctx,
+    RedisModuleString *name,
+    int mode,
+    RedisModuleKey **key,
+    struct priqueue **pq)
+{
+    int type;
+
+    *key = RedisModule_OpenKey(ctx, name, mode);
+    *pq = NULL;
+    type = RedisModule_KeyType(*key);
+    if (type == REDISMODULE_KEYTYPE_EMPTY)
+        return REDISMODULE_OK;
+    if (RedisModule_ModuleTypeGetType(*key) != PriqueType) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    *pq = RedisModule_ModuleTypeGetValue(*key);
+
+    return REDISMODULE_OK;
+}
+
+/* Pops name and replies with the value. Replies nothing and returns 0 when
+ * there is no live item, so PQ.BPOP can keep the client blocked. */
+static int pop_reply(RedisModuleCtx *ctx, RedisModuleString *name)
+{
+    RedisModuleKey *key;
+    struct priqueue *pq;
+    struct pq_item *item;
+    long long taken;
+
+    key = RedisModule_OpenKey(ctx, name, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY
+        || RedisModule_ModuleTypeGetType(key) != PriqueType)
+        return 0;
+    pq = RedisModule_ModuleTypeGetValue(key);
+    item = pq_pop(pq, RedisModule_Milliseconds(), &taken);
+    if (taken > 0)
+        RedisModule_Replicate(ctx, "PQ.DISCARD", "sl", name, taken);
+    if (pq->len == 0)
+        RedisModule_DeleteKey(key);
+    if (item == NULL)
+        return 0;
+    RedisModule_ReplyWithStringBuffer(ctx, item->val, item->len);
+    pq_item_free(item);
+
+    return 1;
+}
+
+static int push_generic(RedisModuleCtx *ctx,
+    RedisModuleString **argv,
+    long long priority,
+    long long seq,
+    long long expire_at)
+{
+    RedisModuleKey *key;
+    struct priqueue *pq;
+    const char *val;
+    size_t len;
+
+    if (open_queue(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE, &key, &pq) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+    if (pq == NULL) {
+        pq = pq_new();
+        RedisModule_ModuleTypeSetValue(key, PriqueType, pq);
+    }
+    if (seq < 0)
+        seq = pq->seq;
+    val = RedisModule_StringPtrLen(argv[4], &len);
+    pq_push(pq, priority, seq, expire_at, val, len);
+    RedisModule_SignalKeyAsReady(ctx, argv[1]);
+    RedisModule_Replicate(ctx, "PQ.PUSHAT", "slllb", argv[1], priority, seq, expire_at, val, len);
+
+    return RedisModule_ReplyWithLongLong(ctx, 1);
+}
+
+/* PQ.PUSH <key> <priority> <expire seconds, 0 for none> <value> */
+static int PushCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    long long priority, expire, expire_at = 0;
+
+    RedisModule_AutoMemory(ctx);
+    if (argc != 5)
+        return RedisModule_WrongArity(ctx);
+    if (RedisModule_StringToLongLong(argv[2], &priority) != REDISMODULE_OK)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid priority");
+    if (RedisModule_StringToLongLong(argv[3], &expire) != REDISMODULE_OK || expire < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid expire");
+    if (expire > 0)
+        expire_at = RedisModule_Milliseconds() + expire * 1000;
+
+    return push_generic(ctx, argv, priority, -1, expire_at);
+}
+
+/* PQ.PUSHAT <key> <priority> <seq> <unix-time-ms, 0 for none> <value>
+ *
+ * Takes six arguments, the value is argv[5]; shift it into place for
+ * push_generic. */
+static int PushAtCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    long long priority, seq, expire_at;
+    RedisModuleString *args[5];
+
+    RedisModule_AutoMemory(ctx);
+    if (argc != 6)
+        return RedisModule_WrongArity(ctx);
+    if (RedisModule_StringToLongLong(argv[2], &priority) != REDISMODULE_OK)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid priority");
+    if (RedisModule_StringToLongLong(argv[3], &seq) != REDISMODULE_OK || seq < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid seq");
+    if (RedisModule_StringToLongLong(argv[4], &expire_at) != REDISMODULE_OK || expire_at < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid expire time");
+    args[0] = argv[0];
+    args[1] = argv[1];
+    args[2] = argv[2];
+    args[3] = argv[3];
+    args[4] = argv[5];
+
+    return push_generic(ctx, args, priority, seq, expire_at);
+}
+
+/* PQ.POP <key> */
+static int PopCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModuleKey *key;
+    struct priqueue *pq;
+
+    RedisModule_AutoMemory(ctx);
+    if (argc != 2)
+        return RedisModule_WrongArity(ctx);
+    if (open_queue(ctx, argv[1], REDISMODULE_READ, &key, &pq) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+    RedisModule_CloseKey(key);
+    if (!pop_reply(ctx, argv[1]))
+        RedisModule_ReplyWithNull(ctx);
+
+    return REDISMODULE_OK;
+}
+
+static int BPopReady(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    RedisModule_AutoMemory(ctx);
+    if (!pop_reply(ctx, RedisModule_GetBlockedClientReadyKey(ctx)))
+        return REDISMODULE_ERR;    /* stay blocked */
+
+    return REDISMODULE_OK;
+}
+
+static int BPopTimeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    return RedisModule_ReplyWithNull(ctx);
+}
+
+/* PQ.BPOP <key> <timeout seconds, 0 blocks forever> */
+static int BPopCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModuleKey *key;
+    struct priqueue *pq;
+    long long timeout;
+
+    RedisModule_AutoMemory(ctx);
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+    if (RedisModule_StringToLongLong(argv[2], &timeout) != REDISMODULE_OK || timeout < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid timeout");
+    if (open_queue(ctx, argv[1], REDISMODULE_READ, &key, &pq) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+    RedisModule_CloseKey(key);
+    if (pop_reply(ctx, argv[1]))
+        return REDISMODULE_OK;
+    /* no blocking inside MULTI or scripts, behave like BRPOP there */
+    if (RedisModule_GetContextFlags(ctx) & (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA))
+        return RedisModule_ReplyWithNull(ctx);
+    RedisModule_BlockClientOnKeys(ctx, BPopReady, BPopTimeout, NULL, timeout * 1000, &argv[1], 1, NULL);
+
+    return REDISMODULE_OK;
+}
+
+/* PQ.LEN <key>; like lenqueue.lua, expired items still count until popped. */
+static int LenCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModuleKey *key;
+    struct priqueue *pq;
+
+    RedisModule_AutoMemory(ctx);
+    if (argc != 2)
+        return RedisModule_WrongArity(ctx);
+    if (open_queue(ctx, argv[1], REDISMODULE_READ, &key, &pq) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+
+    return RedisModule_ReplyWithLongLong(ctx, pq ? (long long)pq->len : 0);
+}
+
+/* PQ.DISCARD <key> <count>: drop count heads regardless of expiry. */
+static int DiscardCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModuleKey *key;
+    struct priqueue *pq;
+    struct pq_item *item;
+    long long count, n = 0;
+
+    RedisModule_AutoMemory(ctx);
+    if (argc != 3)
+        return RedisModule_WrongArity(ctx);
+    if (RedisModule_StringToLongLong(argv[2], &count) != REDISMODULE_OK || count < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid count");
+    if (open_queue(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE, &key, &pq) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+    if (pq == NULL)
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    while (n < count && (item = pq_take(pq)) != NULL) {
+        pq_item_free(item);
+        n++;
+    }
+    if (pq->len == 0)
+        RedisModule_DeleteKey(key);
+    RedisModule_ReplicateVerbatim(ctx);
+
+    return RedisModule_ReplyWithLongLong(ctx, n);
+}
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModuleTypeMethods tm = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .rdb_load = pq_rdb_load,
+        .rdb_save = pq_rdb_save,
+        .aof_rewrite = pq_aof_rewrite,
+        .mem_usage = pq_mem_usage,
+        .free = pq_free,
+    };
+
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    if (RedisModule_Init(ctx, "prique", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    PriqueType = RedisModule_CreateDataType(ctx, PQ_TYPE_NAME, PQ_ENCVER, &tm);
+    if (PriqueType == NULL)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "pq.push", PushCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR
+        || RedisModule_CreateCommand(ctx, "pq.pushat", PushAtCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR
+        || RedisModule_CreateCommand(ctx, "pq.pop", PopCommand, "write fast", 1, 1, 1) == REDISMODULE_ERR
+        || RedisModule_CreateCommand(ctx, "pq.bpop", BPopCommand, "write", 1, 1, 1) == REDISMODULE_ERR
+        || RedisModule_CreateCommand(ctx, "pq.len", LenCommand, "readonly fast", 1, 1, 1) == REDISMODULE_ERR
+        || RedisModule_CreateCommand(ctx, "pq.discard", DiscardCommand, "write", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    return REDISMODULE_OK;
+}
@@ -0,0 +1,671 @@
+/* priquetop: live view of the priqueues (enqueue.lua/dequeue.lua) of a
+ * server. Queues are found by SCAN MATCH <pattern>:priset, every refresh
+ * reads them QUEUE_BATCH at a time with three pipelined round trips:
+ *
+ *   ZREVRANGE <q>:priset 0 -1, GET <q>:cnt,       levels and counters
+ *   GET <q>:coalesced
+ *   LLEN <q>:<p>, LINDEX <q>:<p> -1               depth and oldest id per level
+ *   OBJECT IDLETIME <q>:i:<oldest id>             age of the oldest item
+ *
+ * Items carry no enqueue time; the payload key is never read before it is
+ * dequeued, so its idle time is the time since it was enqueued, or, for an
+ * item a dedup push coalesced into, since it was last rewritten. The enqueue
+ * rate is the growth of <q>:cnt, the dequeue rate what the depth did not
+ * keep of it.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <getopt.h>
+#include <hiredis.h>
+
+#define CONNECT_TIMEOUT { 1, 0 }
+#define SIZE_T_FMT      "zd"
+#define BUFSIZE         (128)
+#define QUEUE_BATCH     (128)
+#define SCAN_COUNT      (1000)
+#define LEVELS_WIDTH    (48)
+
+struct level {
+    char priority[24];
+    long long depth;
+    long long oldest;   /* id of the oldest item, -1 when empty */
+};
+
+struct queue {
+    char *name;
+    struct level *levels;
+    size_t nlevel, maxlevel;
+    long long depth, cnt, coalesced, idle;
+    long long prevdepth, prevcnt, prevcoalesced;
+    double enq_rate, deq_rate, coal_rate;
+    int sampled;
+};
+
+enum {
+    SORT_DEPTH = 0,
+    SORT_GROWTH,
+    SORT_AGE,
+};
+
+static const char *hostip_ = "127.0.0.1", *hostpath_, *passwd_, *pattern_ = "*";
+static int hostport_ = 6379, dbid_, interval_ = 1, rescan_ = 30, top_ = 20, batch_, once_, sort_ = SORT_DEPTH;
+static long long count_ = SCAN_COUNT;
+static struct queue *queues_;
+static size_t nqueue_;
+static long long sampled_at_;
+static redisContext *context_;
+
+static struct option long_options[] = {
+    { "scan", required_argument, 0, '$' },
+    { "count", required_argument, 0, 'c' },
+    { "rescan", required_argument, 0, 'r' },
+    { "top", required_argument, 0, 't' },
+    { "sort", required_argument, 0, 'o' },
+    { "batch", no_argument, &batch_, 1 },
+    { "once", no_argument, &once_, 1 },
+    { 0, 0, 0, 0 }
+};
+
+static void show_usage(const char *prog);
+static void discover();
+static int check_scan_reply(redisReply *reply);
+static int queue_cmp(const void *a, const void *b);
+static struct queue *queue_find(struct queue *qs, size_t n, const char *name);
+static void queue_free(struct queue *q);
+static void refresh();
+static int refresh_batch(struct queue *qs, size_t n);
+static int read_replies(redisReply **replies, size_t n);
+static void free_replies(redisReply **replies, size_t n);
+static void display();
+static int display_cmp(const void *a, const void *b);
+static char *ageToHuman(long long secs, char *buf, size_t size);
+static long long mstime();
+static int ensure_connected();
+static void connect();
+static redisReply *reconnectingRedisCommand(const char *fmt, ...);
+
+int main(int argc, char **argv)
+{
+    int rv, rounds = 0;
+    long long discovered_at = 0;
+    while (1) {
+        int option_index = 0;
+        rv = getopt_long(argc, argv, "h:p:s:a:n:i:", long_options, &option_index);
+        if (rv < 0)
+            break;
+        switch (rv) {
+        case 0:
+            break;
+        case 'h':
+            hostip_ = optarg;
+            break;
+        case 'p':
+            hostport_ = (int)strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            hostpath_ = optarg;
+            break;
+        case 'a':
+            passwd_ = optarg;
+            break;
+        case 'n':
+            dbid_ = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_ = (int)strtol(optarg, NULL, 10);
+            if (interval_ <= 0)
+                interval_ = 1;
+            break;
+        case '$':
+            pattern_ = optarg;
+            break;
+        case 'c':
+            count_ = strtoll(optarg, NULL, 10);
+            break;
+        case 'r':
+            rescan_ = (int)strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            top_ = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            if (strcmp(optarg, "depth") == 0)
+                sort_ = SORT_DEPTH;
+            else if (strcmp(optarg, "growth") == 0)
+                sort_ = SORT_GROWTH;
+            else if (strcmp(optarg, "age") == 0)
+                sort_ = SORT_AGE;
+            else
+                show_usage(argv[0]);
+            break;
+        case '?':
+            show_usage(argv[0]);
+            break;
+        default:
+            abort();
+            break;
+        }
+    }
+    while (1) {
+        if (discovered_at == 0 || (rescan_ > 0 && mstime() - discovered_at >= rescan_ * 1000LL)) {
+            discover();
+            discovered_at = mstime();
+        }
+        refresh();
+        /* --once still needs a second sample for the rates */
+        if (!once_ || ++rounds >= 2) {
+            display();
+            if (once_)
+                break;
+        }
+        sleep(interval_);
+    }
+    if (context_)
+        redisFree(context_);
+    return 0;
+}
+
+static void show_usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [OPTIONS]\n"
+        "  -h <hostname>        Server hostname (default: 127.0.0.1).\n"
+        "  -p <port>            Server port (default: 6379).\n"
+        "  -s <socket>          Server socket (overrides hostname and port).\n"
+        "  -a <password>        Password to use when connecting to the server.\n"
+        "  -n <db>              Database number.\n"
+        "  -i <interval>        Seconds between refreshes (default: 1).\n"
+        "  --scan <pat>         Queue name pattern, matched as <pat>:priset (default: *).\n"
+        "  --count <count>      COUNT hint of the discovery SCAN (default: 1000).\n"
+        "  --rescan <s>         Discover queues again every <s> seconds, 0 to never (default: 30).\n"
+        "  --top <n>            Show the first <n> queues, 0 for all (default: 20).\n"
+        "  --sort <key>         depth, growth (enqueue minus dequeue rate) or age (default: depth).\n"
+        "  --batch              Append every refresh instead of redrawing the screen.\n"
+        "  --once               Print one refresh (two samples, <interval> apart) and exit.\n"
+        "  --help               Output this help and exit.\n",
+        prog);
+    exit(0);
+}
+
+/* 0 if reply is a well-formed SCAN reply, otherwise report it, free it and
+ * return -1 so the caller leaves its cursor loop. */
+static int check_scan_reply(redisReply *reply)
+{
+    if (context_ == NULL || context_->err) {
+        fprintf(stderr, "SCAN error: %s\n", context_ ? context_->errstr : "not connected");
+        if (context_) {
+            redisFree(context_);
+            context_ = NULL;
+        }
+        if (reply)
+            freeReplyObject(reply);
+        return -1;
+    }
+    if (reply == NULL)
+        return -1;
+    if (reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr, "SCAN error: %s\n", reply->str);
+        freeReplyObject(reply);
+        return -1;
+    }
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2
+        || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+        fprintf(stderr, "Non ARRAY response from SCAN\n");
+        freeReplyObject(reply);
+        return -1;
+    }
+    return 0;
+}
+
+/* Rebuild queues_ from a SCAN, carrying the previous sample of the queues
+ * still there so their rates survive the rescan. */
+static void discover()
+{
+    redisReply *reply, *keys;
+    struct queue *qs = NULL, *old;
+    size_t i, j, n = 0, cap = 0;
+    long long cursor = 0;
+    char match[BUFSIZE];
+    snprintf(match, sizeof(match), "%s:priset", pattern_);
+    do {
+        reply = reconnectingRedisCommand("SCAN %lld MATCH %s COUNT %lld", cursor, match, count_);
+        if (check_scan_reply(reply) != 0) {
+            /* keep the previous list rather than a partial one */
+            for (i = 0; i < n; i++)
+                free(qs[i].name);
+            free(qs);
+            return;
+        }
+        keys = reply->element[1];
+        for (j = 0; j < keys->elements; j++) {
+            size_t len = keys->element[j]->len - (sizeof(":priset") - 1);
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                qs = realloc(qs, cap * sizeof(*qs));
+                if (qs == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+            }
+            memset(&qs[n], 0, sizeof(qs[n]));
+            qs[n].name = malloc(len + 1);
+            if (qs[n].name == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            memcpy(qs[n].name, keys->element[j]->str, len);
+            qs[n].name[len] = '\0';
+            qs[n].idle = -1;
+            n++;
+        }
+        cursor = strtoll(reply->element[0]->str, NULL, 10);
+        freeReplyObject(reply);
+    } while (cursor != 0);
+    qsort(qs, n, sizeof(*qs), queue_cmp);
+    /* SCAN may return a key twice */
+    for (i = 0, j = 0; i < n; i++) {
+        if (j > 0 && strcmp(qs[i].name, qs[j - 1].name) == 0) {
+            free(qs[i].name);
+            continue;
+        }
+        qs[j++] = qs[i];
+    }
+    n = j;
+    for (i = 0; i < n; i++) {
+        old = queue_find(queues_, nqueue_, qs[i].name);
+        if (old && old->sampled) {
+            qs[i].depth = old->depth;
+            qs[i].cnt = old->cnt;
+            qs[i].coalesced = old->coalesced;
+            qs[i].sampled = 1;
+        }
+    }
+    for (i = 0; i < nqueue_; i++)
+        queue_free(&queues_[i]);
+    free(queues_);
+    queues_ = qs;
+    nqueue_ = n;
+}
+
+static int queue_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct queue *)a)->name, ((const struct queue *)b)->name);
+}
+
+static struct queue *queue_find(struct queue *qs, size_t n, const char *name)
+{
+    struct queue key;
+    if (n == 0)
+        return NULL;
+    key.name = (char *)name;
+    return bsearch(&key, qs, n, sizeof(*qs), queue_cmp);
+}
+
+static void queue_free(struct queue *q)
+{
+    free(q->name);
+    free(q->levels);
+}
+
+static void refresh()
+{
+    size_t i, n;
+    long long now;
+    double dt;
+    for (i = 0; i < nqueue_; i++) {
+        queues_[i].prevdepth = queues_[i].depth;
+        queues_[i].prevcnt = queues_[i].cnt;
+        queues_[i].prevcoalesced = queues_[i].coalesced;
+    }
+    for (i = 0; i < nqueue_; i += n) {
+        n = nqueue_ - i < QUEUE_BATCH ? nqueue_ - i : QUEUE_BATCH;
+        if (refresh_batch(&queues_[i], n) != 0) {
+            /* partial data makes no rates, start sampling over */
+            for (i = 0; i < nqueue_; i++)
+                queues_[i].sampled = 0;
+            return;
+        }
+    }
+    now = mstime();
+    dt = (now - sampled_at_) / 1000.0;
+    for (i = 0; i < nqueue_; i++) {
+        struct queue *q = &queues_[i];
+        if (q->sampled && q->cnt >= q->prevcnt && dt > 0) {
+            long long enq = q->cnt - q->prevcnt;
+            long long deq = q->prevdepth + enq - q->depth;
+            q->enq_rate = enq / dt;
+            q->deq_rate = deq > 0 ? deq / dt : 0;
+            q->coal_rate = q->coalesced >= q->prevcoalesced ? (q->coalesced - q->prevcoalesced) / dt : 0;
+        } else {
+            /* first sample, or the counter was reset by rmqueue.lua */
+            q->enq_rate = q->deq_rate = q->coal_rate = 0;
+        }
+    }
+    for (i = 0; i < nqueue_; i++)
+        queues_[i].sampled = 1;
+    sampled_at_ = now;
+}
+
+/* Read n queues with three pipelined round trips. */
+static int refresh_batch(struct queue *qs, size_t n)
+{
+    redisReply **replies;
+    size_t i, j, k, nreply, max = 3 * n;
+    if (ensure_connected() != 0)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        redisAppendCommand(context_, "ZREVRANGE %s:priset 0 -1", qs[i].name);
+        redisAppendCommand(context_, "GET %s:cnt", qs[i].name);
+        redisAppendCommand(context_, "GET %s:coalesced", qs[i].name);
+    }
+    replies = malloc(max * sizeof(*replies));
+    if (replies == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (read_replies(replies, 3 * n) != 0) {
+        free(replies);
+        return -1;
+    }
+    nreply = 0;
+    for (i = 0; i < n; i++) {
+        struct queue *q = &qs[i];
+        redisReply *levels = replies[3 * i], *cnt = replies[3 * i + 1], *coalesced = replies[3 * i + 2];
+        q->nlevel = 0;
+        if (levels->type == REDIS_REPLY_ARRAY && levels->elements > q->maxlevel) {
+            q->levels = realloc(q->levels, levels->elements * sizeof(*q->levels));
+            if (q->levels == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            q->maxlevel = levels->elements;
+        }
+        if (levels->type == REDIS_REPLY_ARRAY) {
+            for (j = 0; j < levels->elements; j++) {
+                snprintf(q->levels[j].priority, sizeof(q->levels[j].priority), "%s", levels->element[j]->str);
+                q->levels[j].depth = 0;
+                q->levels[j].oldest = -1;
+            }
+            q->nlevel = levels->elements;
+        }
+        q->cnt = cnt->type == REDIS_REPLY_STRING ? strtoll(cnt->str, NULL, 10) : 0;
+        q->coalesced = coalesced->type == REDIS_REPLY_STRING ? strtoll(coalesced->str, NULL, 10) : 0;
+        nreply += 2 * q->nlevel;
+    }
+    free_replies(replies, 3 * n);
+
+    if (nreply > max) {
+        max = nreply;
+        free(replies);
+        replies = malloc(max * sizeof(*replies));
+        if (replies == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < qs[i].nlevel; j++) {
+            redisAppendCommand(context_, "LLEN %s:%s", qs[i].name, qs[i].levels[j].priority);
+            redisAppendCommand(context_, "LINDEX %s:%s -1", qs[i].name, qs[i].levels[j].priority);
+        }
+    }
+    if (read_replies(replies, nreply) != 0) {
+        free(replies);
+        return -1;
+    }
+    k = 0;
+    nreply = 0;
+    for (i = 0; i < n; i++) {
+        struct queue *q = &qs[i];
+        q->depth = 0;
+        for (j = 0; j < q->nlevel; j++, k += 2) {
+            struct level *l = &q->levels[j];
+            if (replies[k]->type == REDIS_REPLY_INTEGER)
+                l->depth = replies[k]->integer;
+            if (replies[k + 1]->type == REDIS_REPLY_STRING) {
+                l->oldest = strtoll(replies[k + 1]->str, NULL, 10);
+                nreply++;
+            }
+            q->depth += l->depth;
+        }
+    }
+    free_replies(replies, k);
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < qs[i].nlevel; j++) {
+            if (qs[i].levels[j].oldest >= 0)
+                redisAppendCommand(context_, "OBJECT IDLETIME %s:i:%lld", qs[i].name, qs[i].levels[j].oldest);
+        }
+    }
+    if (read_replies(replies, nreply) != 0) {
+        free(replies);
+        return -1;
+    }
+    k = 0;
+    for (i = 0; i < n; i++) {
+        struct queue *q = &qs[i];
+        /* the tail of a level may have expired, take the oldest live one */
+        q->idle = -1;
+        for (j = 0; j < q->nlevel; j++) {
+            if (q->levels[j].oldest < 0)
+                continue;
+            if (replies[k]->type == REDIS_REPLY_INTEGER && replies[k]->integer > q->idle)
+                q->idle = replies[k]->integer;
+            k++;
+        }
+    }
+    free_replies(replies, nreply);
+    free(replies);
+    return 0;
+}
+
+/* Read n pipelined replies. A broken link drops the connection so that the
+ * next refresh reconnects. */
+static int read_replies(redisReply **replies, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (redisGetReply(context_, (void **)&replies[i]) != REDIS_OK) {
+            fprintf(stderr, "Read error: %s\n", context_->errstr);
+            free_replies(replies, i);
+            redisFree(context_);
+            context_ = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_replies(redisReply **replies, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        freeReplyObject(replies[i]);
+}
+
+static void display()
+{
+    struct queue **order;
+    char buf[32], age[16], level[48], levels[LEVELS_WIDTH + 4];
+    time_t t = time(NULL);
+    size_t i, j, n, len;
+    long long depth = 0, idle = -1;
+    double enq = 0, deq = 0, coal = 0;
+    order = malloc((nqueue_ ? nqueue_ : 1) * sizeof(*order));
+    if (order == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < nqueue_; i++) {
+        order[i] = &queues_[i];
+        depth += queues_[i].depth;
+        enq += queues_[i].enq_rate;
+        deq += queues_[i].deq_rate;
+        coal += queues_[i].coal_rate;
+        if (queues_[i].idle > idle)
+            idle = queues_[i].idle;
+    }
+    qsort(order, nqueue_, sizeof(*order), display_cmp);
+    n = top_ > 0 && (size_t)top_ < nqueue_ ? (size_t)top_ : nqueue_;
+
+    if (!batch_)
+        printf("\x1b[H\x1b[2J"); /* Cursor home + clear screen. */
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("[%s] Queues: %" SIZE_T_FMT ", Depth: %lld, Enqueue: %.1f/s, Dequeue: %.1f/s, Coalesced: %.1f/s, Oldest: %s\n",
+        buf, nqueue_, depth, enq, deq, coal, ageToHuman(idle, age, sizeof(age)));
+    printf("%-32s %10s %10s %10s %10s %8s  %s\n", "QUEUE", "DEPTH", "ENQ/s", "DEQ/s", "COAL/s", "OLDEST", "LEVELS");
+    for (i = 0; i < n; i++) {
+        struct queue *q = order[i];
+        len = 0;
+        levels[0] = '\0';
+        for (j = 0; j < q->nlevel; j++) {
+            size_t l = snprintf(level, sizeof(level), "%s%s:%lld", j ? " " : "",
+                q->levels[j].priority, q->levels[j].depth);
+            if (len + l > LEVELS_WIDTH) {
+                strcpy(levels + len, " ...");
+                break;
+            }
+            memcpy(levels + len, level, l + 1);
+            len += l;
+        }
+        printf("%-32s %10lld %10.1f %10.1f %10.1f %8s  %s\n", q->name, q->depth, q->enq_rate, q->deq_rate,
+            q->coal_rate, ageToHuman(q->idle, age, sizeof(age)), levels);
+    }
+    fflush(stdout);
+    free(order);
+}
+
+static int display_cmp(const void *a, const void *b)
+{
+    const struct queue *qa = *(const struct queue **)a, *qb = *(const struct queue **)b;
+    double da, db;
+    switch (sort_) {
+    case SORT_GROWTH:
+        da = qa->enq_rate - qa->deq_rate;
+        db = qb->enq_rate - qb->deq_rate;
+        break;
+    case SORT_AGE:
+        da = qa->idle;
+        db = qb->idle;
+        break;
+    default:
+        da = qa->depth;
+        db = qb->depth;
+        break;
+    }
+    if (da != db)
+        return da < db ? 1 : -1;
+    return strcmp(qa->name, qb->name);
+}
+
+static char *ageToHuman(long long secs, char *buf, size_t size)
+{
+    if (secs < 0)
+        snprintf(buf, size, "-");
+    else if (secs < 60)
+        snprintf(buf, size, "%llds", secs);
+    else if (secs < 3600)
+        snprintf(buf, size, "%lldm%llds", secs / 60, secs % 60);
+    else if (secs < 86400)
+        snprintf(buf, size, "%lldh%lldm", secs / 3600, secs % 3600 / 60);
+    else
+        snprintf(buf, size, "%lldd%lldh", secs / 86400, secs % 86400 / 3600);
+    return buf;
+}
+
+static long long mstime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int ensure_connected()
+{
+    if (context_ && !context_->err)
+        return 0;
+    if (context_)
+        redisFree(context_);
+    connect();
+    if (context_ == NULL) {
+        fprintf(stderr, "Could not connect, retrying on the next refresh\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Open and set up the connection, context_ stays NULL on failure. */
+static void connect()
+{
+    redisContext *c;
+    redisReply *reply;
+    struct timeval timeout = CONNECT_TIMEOUT;
+    context_ = NULL;
+    if (hostpath_ == NULL)
+        c = redisConnectWithTimeout(hostip_, hostport_, timeout);
+    else
+        c = redisConnectUnixWithTimeout(hostpath_, timeout);
+    if (c == NULL || c->err) {
+        if (c)
+            redisFree(c);
+        return;
+    }
+    if (passwd_) {
+        reply = redisCommand(c, "AUTH %s", passwd_);
+        if (c->err || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+            freeReplyObject(reply);
+            redisFree(c);
+            return;
+        }
+        freeReplyObject(reply);
+    }
+    if (dbid_) {
+        reply = redisCommand(c, "SELECT %d", dbid_);
+        if (c->err || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+            freeReplyObject(reply);
+            redisFree(c);
+            return;
+        }
+        freeReplyObject(reply);
+    }
+    context_ = c;
+}
+
+/* Send a command reconnecting the link if needed. */
+static redisReply *reconnectingRedisCommand(const char *fmt, ...)
+{
+    redisReply *reply = NULL;
+    int tries = 0;
+    va_list ap;
+
+    while (reply == NULL) {
+        while (context_ == NULL || context_->err & (REDIS_ERR_IO | REDIS_ERR_EOF)) {
+            printf("\r\x1b[0K"); /* Cursor to left edge + clear line. */
+            printf("Reconnecting... %d\r", ++tries);
+            fflush(stdout);
+            if (context_)
+                redisFree(context_);
+            connect();
+            usleep(1000000);
+        }
+
+        va_start(ap, fmt);
+        reply = redisvCommand(context_, fmt, ap);
+        va_end(ap);
+
+        if (context_->err && !(context_->err & (REDIS_ERR_IO | REDIS_ERR_EOF))) {
+            fprintf(stderr, "Error: %s\n", context_->errstr);
+            exit(1);
+        } else if (tries > 0) {
+            printf("\r\x1b[0K"); /* Cursor to left edge + clear line. */
+        }
+    }
+    return reply;
+}
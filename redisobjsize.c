@@ -28,11 +28,20 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fnmatch.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <hiredis.h>
 
 #define MAX_KEYS        (1024)
@@ -40,19 +49,94 @@
 #define CONNECT_TIMEOUT { 1, 0 }
 #define SIZE_T_FMT      "zd"
 #define BUFSIZE         (128)
+#define MAX_NODES       (1024)
+#define NODE_IP_LEN     (46)
+#define NODE_NAME_LEN   (64)
+#define WATCH_BATCH     (512)
+#define WATCH_BUCKETS   (1024)
+#define WATCH_DRAIN     (64)    /* socket reads per drain of the subscriber */
+#define DEEP_SAMPLES    (100)
+
+/* A server to scan. Without --cluster there is only the seed node given by
+ * -h/-p/-s, otherwise one node per shard, preferring an online replica. */
+struct node {
+    char ip[NODE_IP_LEN];
+    int port;
+    const char *path;
+    int replica;
+    char name[NODE_NAME_LEN];
+    pthread_t tid;
+    size_t total;
+    size_t pattotals[MAX_PATTERNS];
+};
 
 static const char *hostip_ = "127.0.0.1", *hostpath_, *passwd_;
-static int hostport_ = 6379, dbid_, interval_, verbose_;
+static int hostport_ = 6379, dbid_, interval_, verbose_, cluster_;
 static long long count_;
 static const char *keys_[MAX_KEYS], *patterns_[MAX_PATTERNS];
 static size_t nkey_, npattern_;
-static redisContext *context_;
+static struct node seed_, *nodes_;
+static size_t nnode_;
+
+/* --watch keeps the size of every matching key so that a change only costs
+ * one probe of the touched key. */
+struct watch_key {
+    struct watch_key *next;
+    size_t size;
+    int pending;
+    char name[];
+};
+static int watch_, debounce_ = 1000, dump_interval_ = 60;
+static volatile sig_atomic_t dump_requested_;
+static struct watch_key **watch_table_, **watch_pending_;
+static size_t watch_buckets_, watch_nkey_, watch_npending_, watch_maxpending_;
+static size_t watch_totals_[MAX_PATTERNS];
+/* The subscriber is drained while the baseline scan runs, or the events
+ * piling up in its output buffer would get it disconnected. */
+static redisContext *watch_sub_;
+static int watch_lost_;
+
+/* --deep looks inside collections, sampling a bounded number of elements. */
+enum {
+    DEEP_OTHER = 0,
+    DEEP_HASH,
+    DEEP_LIST,
+    DEEP_SET,
+    DEEP_ZSET,
+    DEEP_STREAM,
+};
+struct deep_info {
+    int type;
+    char encoding[32];
+    long long card;
+    size_t sampled, sampbytes, maxelem;
+    size_t maxpart; /* largest hash field or value, zset member: what the
+                     * *-max-listpack-value limits apply to */
+    int nonint;     /* a sampled set member is not an integer */
+};
+struct deep_limits {
+    long long hash_entries, hash_value;
+    long long zset_entries, zset_value;
+    long long set_intset, set_entries;
+    long long list_size;
+    int loaded;
+};
+static int deep_, samples_ = DEEP_SAMPLES;
+static __thread struct deep_limits limits_;
+/* Every scanning thread owns its node and connection. */
+static __thread struct node *node_;
+static __thread redisContext *context_;
 
 static struct option long_options[] = {
     { "key", required_argument, 0, 'k' },
     { "scan", optional_argument, 0, '$' },
     { "count", required_argument, 0, 'c' },
     { "verbose", no_argument, &verbose_, 1 },
+    { "cluster", no_argument, &cluster_, 1 },
+    { "watch", no_argument, &watch_, 1 },
+    { "debounce", required_argument, 0, 'b' },
+    { "dump-interval", required_argument, 0, 'u' },
+    { "deep", optional_argument, 0, 'e' },
     { 0, 0, 0, 0 }
 };
 
@@ -60,9 +144,45 @@ static void show_usage(const char *prog);
 static void objsize();
 static size_t key_count();
 static size_t scan_count();
+static void scan_node();
+static int check_scan_reply(redisReply *reply);
+static void *scan_thread(void *arg);
+static void discover_nodes();
+static int discover_shards();
+static int discover_slots();
+static redisReply *slots_node(redisReply *range, size_t i);
+static int cluster_enabled();
+static void discover_replicas();
+static void add_node(const char *ip, int port, const char *path, int replica);
+static redisReply *reply_field(redisReply *r, const char *name);
+static void watch();
+static void watch_set(const char *key, size_t size);
+static void watch_baseline();
+static redisContext *watch_subscribe();
+static redisContext *watch_resubscribe(redisContext *sub);
+static void watch_check_config();
+static void watch_drain();
+static void watch_event(redisReply *reply);
+static void watch_flush();
+static void watch_dump();
+static void watch_signal(int sig);
+static int watch_matches(const char *key);
+static void watch_account(const char *key, size_t oldsize, size_t newsize);
+static unsigned int watch_hash(const char *key);
+static struct watch_key *watch_lookup(const char *key, int create);
+static void watch_remove(const char *key);
+static long long mstime();
+static void deep_keys(const char **keys, size_t n);
+static int deep_type(const char *type);
+static void deep_sample(struct deep_info *info, redisReply *reply);
+static void deep_report(const char *key, const struct deep_info *info);
+static size_t deep_flag(char *buf, size_t size, const char *name, long long value, long long limit);
+static int deep_integer(const char *s, size_t len);
+static void deep_load_limits();
 static size_t debug_object(const char *key);
 static size_t parse_length_field(const char *str);
 static void connect();
+static redisContext *connect_node();
 static redisReply *reconnectingRedisCommand(const char *fmt, ...);
 static char *bytesToHuman(size_t n);
 
@@ -106,6 +226,19 @@ int main(int argc, char **argv)
         case 'c':
             count_ = strtoll(optarg, NULL, 10);
             break;
+        case 'b':
+            debounce_ = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'u':
+            dump_interval_ = (int)strtol(optarg, NULL, 10);
+            break;
+        case 'e':
+            deep_ = 1;
+            if (optarg)
+                samples_ = (int)strtol(optarg, NULL, 10);
+            if (samples_ <= 0)
+                samples_ = DEEP_SAMPLES;
+            break;
         case '?':
             show_usage(argv[0]);
             break;
@@ -124,6 +257,18 @@ int main(int argc, char **argv)
     }
     if (nkey_ == 0 && npattern_ == 0)
         patterns_[npattern_++] = "*";
+    snprintf(seed_.ip, sizeof(seed_.ip), "%s", hostip_);
+    seed_.port = hostport_;
+    seed_.path = hostpath_;
+    node_ = &seed_;
+    if (watch_) {
+        if (cluster_) {
+            fprintf(stderr, "--watch can not be used with --cluster\n");
+            exit(1);
+        }
+        watch();
+        return 0;
+    }
     objsize();
     return 0;
 }
@@ -143,6 +288,15 @@ static void show_usage(const char *prog)
         "  --scan <pat>         Iterate the DB using the specified pattern.\n"
         "  --count <count>      When iterating the key space, the server will usually return count or a bit more than count elements per call(default: 10).\n"
         "  --verbose            Enable the verbose output.\n"
+        "  --cluster            Discover all shards (CLUSTER SHARDS, CLUSTER SLOTS or INFO replication), scan a\n"
+        "                       replica of each shard where one is online, all shards in parallel.\n"
+        "  --watch              Keep running after the scan, re-sizing only the keys reported by keyspace\n"
+        "                       notifications (needs notify-keyspace-events \"EA\"). SIGUSR1 dumps the totals.\n"
+        "  --debounce <ms>      With --watch, collect changed keys for <ms> before probing them (default: 1000).\n"
+        "  --dump-interval <s>  With --watch, print the totals every <s> seconds, 0 to disable (default: 60).\n"
+        "  --deep[=<samples>]   Also report the cardinality of hashes, lists, sets, sorted sets and streams, the\n"
+        "                       element sizes of up to <samples> elements each (default: 100) and the keys\n"
+        "                       exceeding the listpack/intset limits.\n"
         "  --help               Output this help and exit.\n",
         prog);
     exit(0);
@@ -171,10 +325,41 @@ static void show_usage(const char *prog)
         if ((r)->type != (t)) {                                                 \
             fprintf(stderr, desc "\n");                                         \
             freeReplyObject((r));                                               \
+            next;                                                               \
         }                                                                       \
-        next;                                                                   \
     } while (0)
 
+/* The IF_*_REPLY macros can only return from inside a loop: their "next"
+ * runs within the macro's own do/while, so a break or continue there is a
+ * no-op. Loops use this instead; the reply is freed when it is rejected. */
+static int check_scan_reply(redisReply *reply)
+{
+    if (context_ == NULL || context_->err) {
+        fprintf(stderr, "SCAN error: %s\n", context_ ? context_->errstr : "not connected");
+        if (context_) {
+            redisFree(context_);
+            context_ = NULL;
+        }
+        if (reply)
+            freeReplyObject(reply);
+        return -1;
+    }
+    if (reply == NULL)
+        return -1;
+    if (reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr, "SCAN error: %s\n", reply->str);
+        freeReplyObject(reply);
+        return -1;
+    }
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2
+        || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+        fprintf(stderr, "Non ARRAY response from SCAN\n");
+        freeReplyObject(reply);
+        return -1;
+    }
+    return 0;
+}
+
 static void objsize()
 {
     size_t total = key_count();
@@ -191,6 +376,8 @@ static size_t key_count()
     for (; i < nkey_; i++) {
         total += sl = debug_object(keys_[i]);
         printf("\tKey: %s, Size: %s\n", keys_[i], bytesToHuman(sl));
+        if (deep_)
+            deep_keys(&keys_[i], 1);
     }
     printf("All the size of the key is: %s\n", bytesToHuman(total));
     return total;
@@ -198,40 +385,926 @@ static size_t key_count()
 
 static size_t scan_count()
 {
-    redisReply *reply, *keys;
-    size_t total = 0, pattotal, i = 0, lines = 0;
-    long long cursor = 0;
-    char fmtbuf[BUFSIZE];
+    size_t total = 0, i, j;
     if (npattern_ == 0) return 0;
-    for (; i < npattern_; i++) {
+    if (cluster_) {
+        discover_nodes();
+        for (i = 0; i < nnode_; i++) {
+            if (pthread_create(&nodes_[i].tid, NULL, scan_thread, &nodes_[i]) != 0) {
+                fprintf(stderr, "Failed to create the scanning thread\n");
+                exit(1);
+            }
+        }
+        for (i = 0; i < nnode_; i++)
+            pthread_join(nodes_[i].tid, NULL);
+    } else {
+        nodes_ = &seed_;
+        nnode_ = 1;
+        scan_node();
+    }
+    for (i = 0; i < npattern_; i++) {
         size_t pattotal = 0;
+        for (j = 0; j < nnode_; j++)
+            pattotal += nodes_[j].pattotals[i];
+        printf("\tPattern: %s, Size: %s\n", patterns_[i], bytesToHuman(pattotal));
+        total += pattotal;
+    }
+    if (cluster_) {
+        for (j = 0; j < nnode_; j++) {
+            printf("\tNode: %s (%s), Size: %s\n", nodes_[j].name,
+                nodes_[j].replica ? "replica" : "primary", bytesToHuman(nodes_[j].total));
+            for (i = 0; i < npattern_; i++)
+                printf("\t\tPattern: %s, Size: %s\n", patterns_[i], bytesToHuman(nodes_[j].pattotals[i]));
+        }
+    }
+    printf("All the size of the pattern is: %s\n", bytesToHuman(total));
+    return total;
+}
+
+/* Scan every pattern on node_, accumulating into its totals. */
+static void scan_node()
+{
+    redisReply *reply, *keys;
+    size_t i, j, lines = 0;
+    long long cursor;
+    char fmtbuf[BUFSIZE];
+    for (i = 0; i < npattern_; i++) {
         size_t n = snprintf(fmtbuf, BUFSIZE, "SCAN %%lld");
         if (patterns_[i] && !(patterns_[i][0] == '*' && patterns_[i][1] == '\0'))
             n += snprintf(fmtbuf + n, BUFSIZE - n, " MATCH %s", patterns_[i]);
         if (count_)
             snprintf(fmtbuf + n, BUFSIZE - n, " COUNT %lld", count_);
+        cursor = 0;
         do {
-            size_t j = 0;
             reply = reconnectingRedisCommand(fmtbuf, cursor);
-            IF_ERROR_REPLY(reply, "SCAN error", continue);
-            IF_WRONG_REPLY(reply, REDIS_REPLY_ARRAY, "Non ARRAY response from SCAN", continue);
+            if (check_scan_reply(reply) != 0)
+                break;
             keys = reply->element[1];
             for (j = 0; j < keys->elements; j++) {
-                size_t sl = debug_object(keys->element[i]->str);
+                size_t sl = debug_object(keys->element[j]->str);
                 if (verbose_) {
-                    printf("\t%3" SIZE_T_FMT ") Key: %s, Size: %s\n", ++lines, keys->element[i]->str, bytesToHuman(sl));
+                    if (cluster_)
+                        printf("\t%3" SIZE_T_FMT ") Node: %s, Key: %s, Size: %s\n", ++lines, node_->name, keys->element[j]->str, bytesToHuman(sl));
+                    else
+                        printf("\t%3" SIZE_T_FMT ") Key: %s, Size: %s\n", ++lines, keys->element[j]->str, bytesToHuman(sl));
+                }
+                if (watch_) {
+                    watch_set(keys->element[j]->str, sl);
+                    watch_drain();
                 }
-                pattotal += sl;
-                total += sl;
+                node_->pattotals[i] += sl;
+                node_->total += sl;
+            }
+            if (deep_ && keys->elements > 0) {
+                const char **names = malloc(keys->elements * sizeof(*names));
+                if (names == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+                for (j = 0; j < keys->elements; j++)
+                    names[j] = keys->element[j]->str;
+                deep_keys(names, keys->elements);
+                free(names);
             }
             cursor = strtoll(reply->element[0]->str, NULL, 10);
+            freeReplyObject(reply);
             if (interval_)
                 usleep(interval_);
         } while (cursor != 0);
-        printf("\tPattern: %s, Size: %s\n", patterns_[i], bytesToHuman(pattotal));
+    }
+}
+
+static void *scan_thread(void *arg)
+{
+    node_ = (struct node *)arg;
+    scan_node();
+    if (context_)
+        redisFree(context_);
+    context_ = NULL;
+    return NULL;
+}
+
+/* Build nodes_ from the seed's view of the topology, one node per shard. */
+static void discover_nodes()
+{
+    size_t i;
+    if (discover_shards() != 0 && discover_slots() != 0) {
+        /* Scanning the seed alone would report one shard as the cluster. */
+        if (cluster_enabled()) {
+            fprintf(stderr, "Failed to read the cluster topology\n");
+            exit(1);
+        }
+        discover_replicas();
+    }
+    if (nnode_ == 0) {
+        fprintf(stderr, "No reachable node found\n");
+        exit(1);
+    }
+    if (verbose_) {
+        for (i = 0; i < nnode_; i++)
+            printf("\tScanning node: %s (%s)\n", nodes_[i].name, nodes_[i].replica ? "replica" : "primary");
+    }
+}
+
+/* CLUSTER SHARDS (Redis 7+). Returns -1 when the seed is not a cluster node
+ * or does not know the command. */
+static int discover_shards()
+{
+    redisReply *reply, *members, *m, *pick, *primary, *ip, *port, *f;
+    size_t i, j;
+    reply = reconnectingRedisCommand("CLUSTER SHARDS");
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(reply);
+        return -1;
+    }
+    for (i = 0; i < reply->elements; i++) {
+        members = reply_field(reply->element[i], "nodes");
+        if (members == NULL || members->type != REDIS_REPLY_ARRAY)
+            continue;
+        pick = primary = NULL;
+        for (j = 0; j < members->elements; j++) {
+            m = members->element[j];
+            f = reply_field(m, "health");
+            if (f == NULL || f->str == NULL || strcmp(f->str, "online") != 0)
+                continue;
+            f = reply_field(m, "role");
+            if (f && f->str && strcmp(f->str, "master") == 0)
+                primary = m;
+            else if (pick == NULL)
+                pick = m;
+        }
+        if (pick == NULL)
+            pick = primary;
+        if (pick == NULL) {
+            fprintf(stderr, "Skipping shard %" SIZE_T_FMT ": no online node\n", i);
+            continue;
+        }
+        ip = reply_field(pick, "ip");
+        if (ip == NULL || ip->str == NULL || ip->str[0] == '\0')
+            ip = reply_field(pick, "endpoint");
+        port = reply_field(pick, "port");
+        if (port == NULL)
+            port = reply_field(pick, "tls-port");
+        if (ip == NULL || ip->str == NULL || port == NULL)
+            continue;
+        add_node(ip->str, (int)port->integer, NULL, pick != primary);
+    }
+    freeReplyObject(reply);
+    return 0;
+}
+
+/* CLUSTER SLOTS, for clusters older than Redis 7. Failed replicas are left
+ * out of the reply; a shard serving several slot ranges is listed once per
+ * range, only its first range is taken. */
+static int discover_slots()
+{
+    redisReply *reply, *primary, *pick, *other;
+    size_t i, k;
+    reply = reconnectingRedisCommand("CLUSTER SLOTS");
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(reply);
+        return -1;
+    }
+    for (i = 0; i < reply->elements; i++) {
+        primary = slots_node(reply->element[i], 2);
+        if (primary == NULL)
+            continue;
+        for (k = 0; k < i; k++) {
+            other = slots_node(reply->element[k], 2);
+            if (other && strcmp(other->element[0]->str, primary->element[0]->str) == 0
+                && other->element[1]->integer == primary->element[1]->integer)
+                break;
+        }
+        if (k < i)
+            continue;
+        pick = slots_node(reply->element[i], 3);
+        if (pick == NULL)
+            pick = primary;
+        /* an empty ip is the address we reached the seed on */
+        add_node(pick->element[0]->str[0] ? pick->element[0]->str : seed_.ip,
+            (int)pick->element[1]->integer, NULL, pick != primary);
+    }
+    freeReplyObject(reply);
+    return 0;
+}
+
+/* The i-th element of a CLUSTER SLOTS range if it is a node (ip, port, ...):
+ * 2 is the primary, 3 and on its replicas. */
+static redisReply *slots_node(redisReply *range, size_t i)
+{
+    redisReply *n;
+    if (range->type != REDIS_REPLY_ARRAY || range->elements <= i)
+        return NULL;
+    n = range->element[i];
+    if (n->type != REDIS_REPLY_ARRAY || n->elements < 2
+        || n->element[0]->type != REDIS_REPLY_STRING
+        || n->element[1]->type != REDIS_REPLY_INTEGER)
+        return NULL;
+    return n;
+}
+
+static int cluster_enabled()
+{
+    redisReply *reply;
+    int enabled;
+    reply = reconnectingRedisCommand("INFO cluster");
+    enabled = reply->type == REDIS_REPLY_STRING && strstr(reply->str, "cluster_enabled:1") != NULL;
+    freeReplyObject(reply);
+    return enabled;
+}
+
+/* Standalone primary with replicas: pick the online replica with the least
+ * lag, or the seed itself when it is a replica or has none. */
+static void discover_replicas()
+{
+    redisReply *reply;
+    char ip[NODE_IP_LEN], state[16], bestip[NODE_IP_LEN];
+    int port, bestport = 0, replica;
+    long long offset, lag, bestlag = -1;
+    const char *line;
+    reply = reconnectingRedisCommand("INFO replication");
+    IF_ERROR_REPLY(reply, "INFO error", return);
+    IF_WRONG_REPLY(reply, REDIS_REPLY_STRING, "Non STRING response from INFO", return);
+    replica = strstr(reply->str, "role:slave") != NULL;
+    for (line = reply->str; !replica && line; line = strchr(line, '\n')) {
+        while (*line == '\n' || *line == '\r')
+            line++;
+        lag = 0;
+        if (sscanf(line, "slave%*d:ip=%45[^,],port=%d,state=%15[^,],offset=%lld,lag=%lld",
+                ip, &port, state, &offset, &lag) < 3)
+            continue;
+        if (strcmp(state, "online") != 0)
+            continue;
+        if (bestlag < 0 || lag < bestlag) {
+            snprintf(bestip, sizeof(bestip), "%s", ip);
+            bestport = port;
+            bestlag = lag;
+        }
+    }
+    if (bestlag >= 0)
+        add_node(bestip, bestport, NULL, 1);
+    else
+        add_node(seed_.ip, seed_.port, seed_.path, replica);
+    freeReplyObject(reply);
+}
+
+static void add_node(const char *ip, int port, const char *path, int replica)
+{
+    struct node *n;
+    if (nodes_ == NULL) {
+        nodes_ = calloc(MAX_NODES, sizeof(*nodes_));
+        if (nodes_ == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    if (nnode_ >= MAX_NODES) {
+        fprintf(stderr, "Too many nodes\n");
+        exit(1);
+    }
+    n = &nodes_[nnode_++];
+    snprintf(n->ip, sizeof(n->ip), "%s", ip);
+    n->port = port;
+    n->path = path;
+    n->replica = replica;
+    if (path)
+        snprintf(n->name, sizeof(n->name), "%s", path);
+    else
+        snprintf(n->name, sizeof(n->name), "%s:%d", ip, port);
+}
+
+/* Look up a field of a RESP2 flattened map (name, value, name, value, ...). */
+static redisReply *reply_field(redisReply *r, const char *name)
+{
+    size_t i;
+    if (r == NULL || r->type != REDIS_REPLY_ARRAY)
+        return NULL;
+    for (i = 0; i + 1 < r->elements; i += 2) {
+        if (r->element[i]->type == REDIS_REPLY_STRING
+            && strcmp(r->element[i]->str, name) == 0)
+            return r->element[i + 1];
+    }
+    return NULL;
+}
+
+/* Called for every key the baseline scan sizes while watching. */
+static void watch_set(const char *key, size_t size)
+{
+    struct watch_key *k;
+    if (size == 0) {
+        /* A key an event made pending is left to its probe. */
+        k = watch_lookup(key, 0);
+        if (k && !k->pending)
+            watch_remove(key);
+        return;
+    }
+    k = watch_lookup(key, 1);
+    watch_account(k->name, k->size, size);
+    k->size = size;
+}
+
+/* Re-baseline from scratch, used after the notification link was lost. */
+static void watch_baseline()
+{
+    size_t i;
+    struct watch_key *k, *next;
+    for (i = 0; i < watch_buckets_; i++) {
+        for (k = watch_table_[i]; k; k = next) {
+            next = k->next;
+            free(k);
+        }
+        watch_table_[i] = NULL;
+    }
+    watch_nkey_ = watch_npending_ = 0;
+    memset(watch_totals_, 0, sizeof(watch_totals_));
+    memset(node_->pattotals, 0, sizeof(node_->pattotals));
+    node_->total = 0;
+    scan_node();
+}
+
+static void watch()
+{
+    redisContext *sub;
+    redisReply *reply;
+    struct pollfd pfd;
+    long long now, flush_at = 0, dump_at;
+    int timeout;
+    signal(SIGUSR1, watch_signal);
+    watch_check_config();
+    /* Subscribe before the baseline so that nothing changing while it runs
+     * is missed, such keys are simply probed once more afterwards. */
+    while ((sub = watch_subscribe()) == NULL)
+        usleep(1000000);
+    watch_sub_ = sub;
+    objsize();
+    watch_sub_ = NULL;
+    dump_at = mstime() + dump_interval_ * 1000LL;
+    while (1) {
+        reply = NULL;
+        if (watch_lost_ || redisReaderGetReply(sub->reader, (void **)&reply) != REDIS_OK) {
+            sub = watch_resubscribe(sub);
+            continue;
+        }
+        now = mstime();
+        if (reply) {
+            watch_event(reply);
+            freeReplyObject(reply);
+        } else {
+            timeout = -1;
+            if (flush_at)
+                timeout = (int)(flush_at > now ? flush_at - now : 0);
+            if (dump_interval_ && (timeout < 0 || dump_at - now < timeout))
+                timeout = (int)(dump_at > now ? dump_at - now : 0);
+            pfd.fd = sub->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, timeout) > 0 && redisBufferRead(sub) != REDIS_OK) {
+                sub = watch_resubscribe(sub);
+                continue;
+            }
+            now = mstime();
+        }
+        /* Also keys left pending by a baseline scan. */
+        if (watch_npending_ && flush_at == 0)
+            flush_at = now + debounce_;
+        if (watch_npending_ >= WATCH_BATCH || (flush_at && now >= flush_at)) {
+            watch_flush();
+            flush_at = watch_npending_ ? now + debounce_ : 0;
+        }
+        if (dump_requested_ || (dump_interval_ && now >= dump_at)) {
+            dump_requested_ = 0;
+            watch_dump();
+            dump_at = now + dump_interval_ * 1000LL;
+        }
+    }
+}
+
+/* Open a connection to node_ listening to every key event of the database. */
+static redisContext *watch_subscribe()
+{
+    redisContext *c;
+    redisReply *reply;
+    c = connect_node();
+    if (c == NULL)
+        return NULL;
+    reply = redisCommand(c, "PSUBSCRIBE __keyevent@%d__:*", dbid_);
+    if (c->err || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        freeReplyObject(reply);
+        redisFree(c);
+        return NULL;
+    }
+    freeReplyObject(reply);
+    return c;
+}
+
+static redisContext *watch_resubscribe(redisContext *sub)
+{
+    fprintf(stderr, "Keyspace notification link lost: %s, rescanning\n", sub->errstr);
+    if (sub->err == REDIS_ERR_EOF)
+        fprintf(stderr, "Warning: the server closed the link, "
+            "check whether client-output-buffer-limit pubsub is too low for the event rate\n");
+    redisFree(sub);
+    while ((sub = watch_subscribe()) == NULL)
+        usleep(1000000);
+    watch_lost_ = 0;
+    watch_sub_ = sub;
+    watch_baseline();
+    watch_sub_ = NULL;
+    return sub;
+}
+
+/* Read the events that arrived on the subscriber without blocking, called
+ * between the keys of a baseline scan. The keys they touch are sized in
+ * batches meanwhile; a lost link is only noted, the scan goes on and
+ * watch() rescans once it is over. */
+static void watch_drain()
+{
+    redisReply *reply;
+    struct pollfd pfd;
+    int i;
+    if (watch_sub_ == NULL || watch_lost_)
+        return;
+    pfd.fd = watch_sub_->fd;
+    pfd.events = POLLIN;
+    for (i = 0; i < WATCH_DRAIN && poll(&pfd, 1, 0) > 0; i++) {
+        if (redisBufferRead(watch_sub_) != REDIS_OK) {
+            watch_lost_ = 1;
+            return;
+        }
+        while (1) {
+            reply = NULL;
+            if (redisReaderGetReply(watch_sub_->reader, (void **)&reply) != REDIS_OK) {
+                watch_lost_ = 1;
+                return;
+            }
+            if (reply == NULL)
+                break;
+            watch_event(reply);
+            freeReplyObject(reply);
+        }
+    }
+    if (watch_npending_ >= WATCH_BATCH)
+        watch_flush();
+}
+
+static void watch_check_config()
+{
+    redisReply *reply;
+    const char *flags;
+    reply = reconnectingRedisCommand("CONFIG GET notify-keyspace-events");
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
+        flags = reply->element[1]->str;
+        if (strchr(flags, 'E') == NULL || (strchr(flags, 'A') == NULL && strchr(flags, 'g') == NULL))
+            fprintf(stderr, "Warning: notify-keyspace-events is \"%s\", "
+                "at least \"EA\" is needed to see every change\n", flags);
+    }
+    freeReplyObject(reply);
+}
+
+/* A pmessage from __keyevent@<db>__:<event> carries the key as payload. */
+static void watch_event(redisReply *reply)
+{
+    struct watch_key *k;
+    const char *event, *key;
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 4
+        || strcmp(reply->element[0]->str, "pmessage") != 0)
+        return;
+    event = strstr(reply->element[2]->str, "__:");
+    key = reply->element[3]->str;
+    if (event == NULL || !watch_matches(key))
+        return;
+    event += 3;
+    if (strcmp(event, "del") == 0 || strcmp(event, "expired") == 0
+        || strcmp(event, "evicted") == 0 || strcmp(event, "rename_from") == 0
+        || strcmp(event, "move_from") == 0) {
+        /* Gone for sure, no need to ask. A pending key is left to its probe. */
+        k = watch_lookup(key, 0);
+        if (k && !k->pending)
+            watch_remove(key);
+        return;
+    }
+    k = watch_lookup(key, 1);
+    if (!k->pending) {
+        if (watch_npending_ == watch_maxpending_) {
+            /* Only grows past WATCH_BATCH while the server is unreachable
+             * or a drain reads a burst. */
+            watch_maxpending_ = watch_maxpending_ ? watch_maxpending_ * 2 : WATCH_BATCH;
+            watch_pending_ = realloc(watch_pending_, watch_maxpending_ * sizeof(*watch_pending_));
+            if (watch_pending_ == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        k->pending = 1;
+        watch_pending_[watch_npending_++] = k;
+    }
+}
+
+/* Size every pending key with one pipelined round trip. */
+static void watch_flush()
+{
+    redisReply *reply;
+    struct watch_key *k;
+    size_t i, n = watch_npending_;
+    if (context_ == NULL || context_->err) {
+        if (context_)
+            redisFree(context_);
+        connect();
+        if (context_ == NULL)
+            return;
+    }
+    for (i = 0; i < n; i++)
+        redisAppendCommand(context_, "DEBUG OBJECT %s", watch_pending_[i]->name);
+    for (i = 0; i < n; i++) {
+        if (redisGetReply(context_, (void **)&reply) != REDIS_OK) {
+            /* Keep the unanswered keys for the next round. */
+            memmove(watch_pending_, watch_pending_ + i, (n - i) * sizeof(*watch_pending_));
+            watch_npending_ = n - i;
+            return;
+        }
+        k = watch_pending_[i];
+        k->pending = 0;
+        if (reply->type == REDIS_REPLY_STATUS) {
+            watch_account(k->name, k->size, parse_length_field(reply->str));
+            k->size = parse_length_field(reply->str);
+        } else if (reply->type == REDIS_REPLY_ERROR && strstr(reply->str, "no such key")) {
+            watch_remove(k->name);
+        } else {
+            if (reply->type == REDIS_REPLY_ERROR)
+                fprintf(stderr, "DEBUG OBJECT error: %s\n", reply->str);
+            if (k->size == 0)
+                watch_remove(k->name);
+        }
+        freeReplyObject(reply);
+    }
+    watch_npending_ = 0;
+}
+
+static void watch_dump()
+{
+    char buf[32];
+    time_t t = time(NULL);
+    size_t i, total = 0;
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("[%s] Keys: %" SIZE_T_FMT "\n", buf, watch_nkey_);
+    for (i = 0; i < npattern_; i++) {
+        printf("\tPattern: %s, Size: %s\n", patterns_[i], bytesToHuman(watch_totals_[i]));
+        total += watch_totals_[i];
     }
     printf("All the size of the pattern is: %s\n", bytesToHuman(total));
-    return total;
+    fflush(stdout);
+}
+
+static void watch_signal(int sig)
+{
+    (void)sig;
+    dump_requested_ = 1;
+}
+
+static int watch_matches(const char *key)
+{
+    size_t i;
+    for (i = 0; i < npattern_; i++) {
+        if (fnmatch(patterns_[i], key, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Move a key from oldsize to newsize in every pattern it belongs to. */
+static void watch_account(const char *key, size_t oldsize, size_t newsize)
+{
+    size_t i;
+    for (i = 0; i < npattern_; i++) {
+        if (fnmatch(patterns_[i], key, 0) == 0)
+            watch_totals_[i] += newsize - oldsize;
+    }
+}
+
+static unsigned int watch_hash(const char *key)
+{
+    unsigned int h = 5381;
+    while (*key)
+        h = h * 33 + (unsigned char)*key++;
+    return h;
+}
+
+static struct watch_key *watch_lookup(const char *key, int create)
+{
+    struct watch_key *k, **table, *next;
+    size_t i, len;
+    if (watch_table_) {
+        for (k = watch_table_[watch_hash(key) & (watch_buckets_ - 1)]; k; k = k->next) {
+            if (strcmp(k->name, key) == 0)
+                return k;
+        }
+    }
+    if (!create)
+        return NULL;
+    if (watch_nkey_ >= watch_buckets_) {
+        /* Keep the chains short by doubling the buckets. */
+        len = watch_buckets_ ? watch_buckets_ * 2 : WATCH_BUCKETS;
+        table = calloc(len, sizeof(*table));
+        if (table == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (i = 0; i < watch_buckets_; i++) {
+            for (k = watch_table_[i]; k; k = next) {
+                next = k->next;
+                k->next = table[watch_hash(k->name) & (len - 1)];
+                table[watch_hash(k->name) & (len - 1)] = k;
+            }
+        }
+        free(watch_table_);
+        watch_table_ = table;
+        watch_buckets_ = len;
+    }
+    len = strlen(key);
+    k = malloc(sizeof(*k) + len + 1);
+    if (k == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memcpy(k->name, key, len + 1);
+    k->size = 0;
+    k->pending = 0;
+    i = watch_hash(key) & (watch_buckets_ - 1);
+    k->next = watch_table_[i];
+    watch_table_[i] = k;
+    watch_nkey_++;
+    return k;
+}
+
+static void watch_remove(const char *key)
+{
+    struct watch_key *k, **prev;
+    if (watch_table_ == NULL)
+        return;
+    prev = &watch_table_[watch_hash(key) & (watch_buckets_ - 1)];
+    for (k = *prev; k; prev = &k->next, k = k->next) {
+        if (strcmp(k->name, key) == 0) {
+            watch_account(k->name, k->size, 0);
+            *prev = k->next;
+            free(k);
+            watch_nkey_--;
+            return;
+        }
+    }
+}
+
+static long long mstime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Profile the collections among keys: cardinality, sampled element sizes and
+ * whether the compact encodings' limits are exceeded. Two pipelined round
+ * trips per call whatever the number of keys. */
+static void deep_keys(const char **keys, size_t n)
+{
+    struct deep_info *info;
+    redisReply *reply;
+    size_t i, ncmd = 0;
+    if (n == 0)
+        return;
+    if (!limits_.loaded)
+        deep_load_limits();
+    info = calloc(n, sizeof(*info));
+    if (info == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (context_ == NULL || context_->err)
+        goto out;
+    for (i = 0; i < n; i++) {
+        redisAppendCommand(context_, "TYPE %s", keys[i]);
+        redisAppendCommand(context_, "OBJECT ENCODING %s", keys[i]);
+    }
+    for (i = 0; i < n; i++) {
+        if (redisGetReply(context_, (void **)&reply) != REDIS_OK)
+            goto out;
+        if (reply->type == REDIS_REPLY_STATUS)
+            info[i].type = deep_type(reply->str);
+        freeReplyObject(reply);
+        if (redisGetReply(context_, (void **)&reply) != REDIS_OK)
+            goto out;
+        if (reply->type == REDIS_REPLY_STRING || reply->type == REDIS_REPLY_STATUS)
+            snprintf(info[i].encoding, sizeof(info[i].encoding), "%s", reply->str);
+        freeReplyObject(reply);
+    }
+    for (i = 0; i < n; i++) {
+        switch (info[i].type) {
+        case DEEP_HASH:
+            redisAppendCommand(context_, "HLEN %s", keys[i]);
+            redisAppendCommand(context_, "HSCAN %s 0 COUNT %d", keys[i], samples_);
+            break;
+        case DEEP_LIST:
+            redisAppendCommand(context_, "LLEN %s", keys[i]);
+            redisAppendCommand(context_, "LRANGE %s 0 %d", keys[i], samples_ - 1);
+            break;
+        case DEEP_SET:
+            redisAppendCommand(context_, "SCARD %s", keys[i]);
+            redisAppendCommand(context_, "SSCAN %s 0 COUNT %d", keys[i], samples_);
+            break;
+        case DEEP_ZSET:
+            redisAppendCommand(context_, "ZCARD %s", keys[i]);
+            redisAppendCommand(context_, "ZSCAN %s 0 COUNT %d", keys[i], samples_);
+            break;
+        case DEEP_STREAM:
+            redisAppendCommand(context_, "XLEN %s", keys[i]);
+            redisAppendCommand(context_, "XRANGE %s - + COUNT %d", keys[i], samples_);
+            break;
+        default:
+            continue;
+        }
+        ncmd++;
+    }
+    for (i = 0; i < n && ncmd > 0; i++) {
+        if (info[i].type == DEEP_OTHER)
+            continue;
+        if (redisGetReply(context_, (void **)&reply) != REDIS_OK)
+            goto out;
+        if (reply->type == REDIS_REPLY_INTEGER)
+            info[i].card = reply->integer;
+        freeReplyObject(reply);
+        if (redisGetReply(context_, (void **)&reply) != REDIS_OK)
+            goto out;
+        deep_sample(&info[i], reply);
+        freeReplyObject(reply);
+        deep_report(keys[i], &info[i]);
+        ncmd--;
+    }
+out:
+    if (context_ && context_->err) {
+        fprintf(stderr, "Deep profiling error: %s\n", context_->errstr);
+        redisFree(context_);
+        context_ = NULL;
+    }
+    free(info);
+}
+
+static int deep_type(const char *type)
+{
+    if (strcmp(type, "hash") == 0)
+        return DEEP_HASH;
+    if (strcmp(type, "list") == 0)
+        return DEEP_LIST;
+    if (strcmp(type, "set") == 0)
+        return DEEP_SET;
+    if (strcmp(type, "zset") == 0)
+        return DEEP_ZSET;
+    if (strcmp(type, "stream") == 0)
+        return DEEP_STREAM;
+    return DEEP_OTHER;
+}
+
+/* Element sizes from a sampling reply. A hash element is a field and its
+ * value, a sorted set element a member and its score, a stream element an
+ * entry id and all its fields. */
+static void deep_sample(struct deep_info *info, redisReply *reply)
+{
+    redisReply *elems = reply, *e;
+    size_t i, j, size, step = 1;
+    if (reply->type != REDIS_REPLY_ARRAY)
+        return;
+    if (info->type == DEEP_HASH || info->type == DEEP_SET || info->type == DEEP_ZSET) {
+        if (reply->elements != 2)
+            return;
+        elems = reply->element[1];
+        if (info->type != DEEP_SET)
+            step = 2;
+    }
+    for (i = 0; i + step <= elems->elements; i += step) {
+        size = 0;
+        if (info->type == DEEP_STREAM) {
+            e = elems->element[i];
+            if (e->type != REDIS_REPLY_ARRAY || e->elements != 2
+                || e->element[1]->type != REDIS_REPLY_ARRAY)
+                continue;
+            size = e->element[0]->len;
+            for (j = 0; j < e->element[1]->elements; j++)
+                size += e->element[1]->element[j]->len;
+        } else {
+            for (j = 0; j < step; j++) {
+                size += elems->element[i + j]->len;
+                /* the zset limit is on the member alone, not its score */
+                if ((info->type == DEEP_HASH || (info->type == DEEP_ZSET && j == 0))
+                    && elems->element[i + j]->len > info->maxpart)
+                    info->maxpart = elems->element[i + j]->len;
+            }
+            if (info->type == DEEP_SET && !deep_integer(elems->element[i]->str, elems->element[i]->len))
+                info->nonint = 1;
+        }
+        info->sampled++;
+        info->sampbytes += size;
+        if (size > info->maxelem)
+            info->maxelem = size;
+    }
+}
+
+static void deep_report(const char *key, const struct deep_info *info)
+{
+    static const char *types[] = { "other", "hash", "list", "set", "zset", "stream" };
+    char avg[16], max[16], est[16], flags[256];
+    size_t n = 0, mean = info->sampled ? info->sampbytes / info->sampled : 0;
+    flags[0] = '\0';
+    switch (info->type) {
+    case DEEP_HASH:
+        n += deep_flag(flags + n, sizeof(flags) - n, "hash-max-listpack-entries", info->card, limits_.hash_entries);
+        n += deep_flag(flags + n, sizeof(flags) - n, "hash-max-listpack-value", info->maxpart, limits_.hash_value);
+        break;
+    case DEEP_ZSET:
+        n += deep_flag(flags + n, sizeof(flags) - n, "zset-max-listpack-entries", info->card, limits_.zset_entries);
+        n += deep_flag(flags + n, sizeof(flags) - n, "zset-max-listpack-value", info->maxpart, limits_.zset_value);
+        break;
+    case DEEP_SET:
+        /* Only sets of integers can be intset encoded. */
+        if (strcmp(info->encoding, "intset") == 0 || (info->sampled > 0 && !info->nonint))
+            n += deep_flag(flags + n, sizeof(flags) - n, "set-max-intset-entries", info->card, limits_.set_intset);
+        n += deep_flag(flags + n, sizeof(flags) - n, "set-max-listpack-entries", info->card, limits_.set_entries);
+        break;
+    case DEEP_LIST:
+        /* Positive: entries per node, negative: bytes per node (-1 is 4K). */
+        if (limits_.list_size > 0)
+            n += deep_flag(flags + n, sizeof(flags) - n, "list-max-listpack-size", info->card, limits_.list_size);
+        else if (limits_.list_size < 0 && limits_.list_size >= -5)
+            n += deep_flag(flags + n, sizeof(flags) - n, "list-max-listpack-size",
+                mean * info->card, 4096LL << (-limits_.list_size - 1));
+        break;
+    default:
+        break;
+    }
+    strcpy(avg, bytesToHuman(mean));
+    strcpy(max, bytesToHuman(info->maxelem));
+    strcpy(est, bytesToHuman(mean * info->card));
+    printf("\t\tKey: %s, Type: %s, Encoding: %s, Elements: %lld, Sampled: %" SIZE_T_FMT
+        ", Avg element: %s, Max element: %s, Estimated: %s%s\n",
+        key, types[info->type], info->encoding, info->card, info->sampled, avg, max, est, flags);
+}
+
+static size_t deep_flag(char *buf, size_t size, const char *name, long long value, long long limit)
+{
+    int n;
+    if (limit <= 0 || value <= limit || size <= 1)
+        return 0;
+    n = snprintf(buf, size, " [exceeds %s %lld]", name, limit);
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+/* Whether a set member would be stored in an intset: the canonical decimal
+ * form of a 64 bit integer, as Redis' string2ll accepts it. */
+static int deep_integer(const char *s, size_t len)
+{
+    char buf[24], *end;
+    if (s == NULL || len == 0 || len >= sizeof(buf))
+        return 0;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    if (!(buf[0] == '-' || (buf[0] >= '0' && buf[0] <= '9')))
+        return 0;
+    if ((buf[0] == '0' && len > 1) || (buf[0] == '-' && (len == 1 || buf[1] == '0')))
+        return 0;
+    errno = 0;
+    strtoll(buf, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+/* The encoding limits of the server node_ is connected to. The ziplist
+ * names are the pre-7.0 aliases of the listpack ones. */
+static void deep_load_limits()
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } names[] = {
+        { "hash-max-listpack-entries", offsetof(struct deep_limits, hash_entries) },
+        { "hash-max-ziplist-entries", offsetof(struct deep_limits, hash_entries) },
+        { "hash-max-listpack-value", offsetof(struct deep_limits, hash_value) },
+        { "hash-max-ziplist-value", offsetof(struct deep_limits, hash_value) },
+        { "zset-max-listpack-entries", offsetof(struct deep_limits, zset_entries) },
+        { "zset-max-ziplist-entries", offsetof(struct deep_limits, zset_entries) },
+        { "zset-max-listpack-value", offsetof(struct deep_limits, zset_value) },
+        { "zset-max-ziplist-value", offsetof(struct deep_limits, zset_value) },
+        { "set-max-intset-entries", offsetof(struct deep_limits, set_intset) },
+        { "set-max-listpack-entries", offsetof(struct deep_limits, set_entries) },
+        { "list-max-listpack-size", offsetof(struct deep_limits, list_size) },
+        { "list-max-ziplist-size", offsetof(struct deep_limits, list_size) },
+    };
+    redisReply *reply;
+    size_t i, j;
+    limits_.loaded = 1;
+    reply = reconnectingRedisCommand("CONFIG GET *-max-*");
+    IF_ERROR_REPLY(reply, "CONFIG GET error, encoding limits are not checked", return);
+    IF_WRONG_REPLY(reply, REDIS_REPLY_ARRAY, "Non ARRAY response from CONFIG GET", return);
+    for (i = 0; i + 1 < reply->elements; i += 2) {
+        for (j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+            if (strcmp(reply->element[i]->str, names[j].name) == 0)
+                *(long long *)((char *)&limits_ + names[j].offset) = strtoll(reply->element[i + 1]->str, NULL, 10);
+        }
+    }
+    freeReplyObject(reply);
 }
 
 static size_t debug_object(const char *key)
@@ -263,39 +1336,48 @@ static size_t parse_length_field(const char *str)
 
 static void connect()
 {
+    context_ = connect_node();
+}
+
+/* Open and set up a new connection to node_, NULL on failure. */
+static redisContext *connect_node()
+{
+    redisContext *c;
     redisReply *reply;
     struct timeval timeout = CONNECT_TIMEOUT;
-    if (hostpath_ == NULL)
-        context_ = redisConnectWithTimeout(hostip_, hostport_, timeout);
+    if (node_->path == NULL)
+        c = redisConnectWithTimeout(node_->ip, node_->port, timeout);
     else
-        context_ = redisConnectUnixWithTimeout(hostpath_, timeout);
-    if (context_ == NULL || context_->err) {
-        if (context_)
-            redisFree(context_);
-        context_ = NULL;
-        return;
+        c = redisConnectUnixWithTimeout(node_->path, timeout);
+    if (c == NULL || c->err) {
+        if (c)
+            redisFree(c);
+        return NULL;
     }
     if (passwd_) {
-        reply = redisCommand(context_, "AUTH %s", passwd_);
-        if (context_->err || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        reply = redisCommand(c, "AUTH %s", passwd_);
+        if (c->err || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
             freeReplyObject(reply);
-            redisFree(context_);
-            context_ = NULL;
-            return;
+            redisFree(c);
+            return NULL;
         }
         freeReplyObject(reply);
     }
     if (dbid_) {
-        reply = redisCommand(context_, "SELECT %d", dbid_);
-        if (context_->err || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        reply = redisCommand(c, "SELECT %d", dbid_);
+        if (c->err || reply == NULL || reply->type == REDIS_REPLY_ERROR) {
             freeReplyObject(reply);
-            redisFree(context_);
-            context_ = NULL;
-            return;
+            redisFree(c);
+            return NULL;
         }
         freeReplyObject(reply);
     }
-    return;
+    if (cluster_ && node_->replica) {
+        /* Let a cluster replica serve DEBUG OBJECT instead of redirecting. */
+        reply = redisCommand(c, "READONLY");
+        freeReplyObject(reply);
+    }
+    return c;
 }
 
 /* Send a command reconnecting the link if needed. */
@@ -334,7 +1416,7 @@ static redisReply *reconnectingRedisCommand(const char *fmt, ...)
  * 100B, 2G, 100M, 4K, and so forth. */
 static char *bytesToHuman(size_t n)
 {
-    static char readable[16];
+    static __thread char readable[16];
     double d;
     if (n < 1024) {
         /* Bytes */
@@ -3,6 +3,10 @@ local signal_queue = priqueue_prefix;
 local priority_set = priqueue_prefix .. ':priset';
 local key = priqueue_prefix .. ':i';
 local counter = priqueue_prefix .. ':cnt';
+local cursor = priqueue_prefix .. ':drr';
+local dedup = priqueue_prefix .. ':dedup';
+local dedup_rev = priqueue_prefix .. ':dedupkey';
+local coalesced = priqueue_prefix .. ':coalesced';
 local rv, res = 0;
 
 rv = redis.call('ZREVRANGE', priority_set, 0, -1);
@@ -26,5 +30,9 @@ end
 redis.call('DEL', priority_set);
 redis.call('DEL', signal_queue);
 redis.call('DEL', counter);
+redis.call('DEL', cursor);
+redis.call('DEL', dedup);
+redis.call('DEL', dedup_rev);
+redis.call('DEL', coalesced);
 
 return res;
@@ -0,0 +1,1314 @@
+#include "rwlock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <assert.h>
+#include "hiredis/hiredis.h"
+#include "hiredis/async.h"
+#include "hiredis/adapters/libev.h"
+
+#define BACKOFF_MIN     1   /* ms */
+#define BACKOFF_MAX     64  /* ms */
+#define SHA1_SIZE       41
+#define WAKE_TTL        60000   /* ms */
+#define WAKE_POLL       1000    /* ms, bounds a wait on a holder that expires */
+#define INTENT_TTL      3000    /* ms, refreshed by every try of a waiting writer */
+#define LEASE_POLL      1000    /* ms, longest time between two lease extensions */
+
+/* Per instance state of an op. */
+enum {
+    IDLE = 0,
+    INFLIGHT,
+    GRANTED,
+    SKIPPED,    /* not sent to, the instance is not part of the op */
+};
+
+enum {
+    TRY_RLOCK = 0,
+    TRY_WLOCK,
+    TRY_UNRLOCK,
+    TRY_UNWLOCK,
+    TRY_WAKE,
+    TRY_EXTEND,
+    NSCRIPT,
+};
+
+/* Same scripts as rwlock.php, plus TRY_EXTEND for the shared read leases. */
+static const char *scripts[NSCRIPT] = {
+    "local rdkey = KEYS[1]\n"
+    "local wrkey = KEYS[2]\n"
+    "local intentkey = KEYS[3]\n"
+    "local ttl = ARGV[1]\n"
+    "local yield = ARGV[2]\n"
+    "local rv\n"
+    "if redis.call(\"EXISTS\", wrkey) == 1 then\n"
+    "    return 0\n"
+    "end\n"
+    "if yield == \"1\" and redis.call(\"EXISTS\", intentkey) == 1 then\n"
+    "    return 0\n"
+    "end\n"
+    "rv = redis.call(\"INCR\", rdkey)\n"
+    "if redis.call(\"PTTL\", rdkey) < tonumber(ttl) then\n"
+    "    redis.call(\"PEXPIRE\", rdkey, ttl)\n"
+    "end\n"
+    "return rv\n",
+
+    "local wrkey = KEYS[1]\n"
+    "local rdkey = KEYS[2]\n"
+    "local intentkey = KEYS[3]\n"
+    "local ttl = ARGV[1]\n"
+    "local token = ARGV[2]\n"
+    "local intentttl = tonumber(ARGV[3])\n"
+    "local owner = redis.call(\"GET\", intentkey)\n"
+    "if redis.call(\"EXISTS\", wrkey) == 0 and redis.call(\"EXISTS\", rdkey) == 0 then\n"
+    "   redis.call(\"PSETEX\", wrkey, ttl, token)\n"
+    "   if owner == token then\n"
+    "       redis.call(\"DEL\", intentkey)\n"
+    "   end\n"
+    "   return 1\n"
+    "end\n"
+    "if intentttl > 0 and (owner == false or owner == token) then\n"
+    "    redis.call(\"PSETEX\", intentkey, intentttl, token)\n"
+    "end\n"
+    "return 0\n",
+
+    "local rdkey = KEYS[1]\n"
+    "local wakekey = KEYS[2]\n"
+    "local wakettl = ARGV[1]\n"
+    "local rv\n"
+    "if redis.call(\"EXISTS\", rdkey) == 0 then\n"
+    "    return 0\n"
+    "end\n"
+    "rv = redis.call(\"DECR\", rdkey)\n"
+    "if rv <= 0 then\n"
+    "    redis.call(\"DEL\", rdkey)\n"
+    "    redis.call(\"LPUSH\", wakekey, 1)\n"
+    "    redis.call(\"LTRIM\", wakekey, 0, 0)\n"
+    "    redis.call(\"PEXPIRE\", wakekey, wakettl)\n"
+    "end\n"
+    "return rv\n",
+
+    "local wrkey = KEYS[1]\n"
+    "local wakekey = KEYS[2]\n"
+    "local intentkey = KEYS[3]\n"
+    "local token = ARGV[1]\n"
+    "local wakettl = ARGV[2]\n"
+    "local rv = 0\n"
+    "if redis.call(\"GET\", intentkey) == token then\n"
+    "    redis.call(\"DEL\", intentkey)\n"
+    "    rv = -1\n"
+    "end\n"
+    "if redis.call(\"GET\", wrkey) == token then\n"
+    "    rv = redis.call(\"DEL\", wrkey)\n"
+    "end\n"
+    "if rv ~= 0 then\n"
+    "    redis.call(\"LPUSH\", wakekey, 1)\n"
+    "    redis.call(\"LTRIM\", wakekey, 0, 0)\n"
+    "    redis.call(\"PEXPIRE\", wakekey, wakettl)\n"
+    "end\n"
+    "return rv\n",
+
+    "local wakekey = KEYS[1]\n"
+    "local wakettl = ARGV[1]\n"
+    "redis.call(\"LPUSH\", wakekey, 1)\n"
+    "redis.call(\"LTRIM\", wakekey, 0, 0)\n"
+    "redis.call(\"PEXPIRE\", wakekey, wakettl)\n"
+    "return 1\n",
+
+    "local rdkey = KEYS[1]\n"
+    "local intentkey = KEYS[2]\n"
+    "local ttl = ARGV[1]\n"
+    "local yield = ARGV[2]\n"
+    "if redis.call(\"EXISTS\", rdkey) == 0 then\n"
+    "    return 0\n"
+    "end\n"
+    "if redis.call(\"PTTL\", rdkey) < tonumber(ttl) then\n"
+    "    redis.call(\"PEXPIRE\", rdkey, ttl)\n"
+    "end\n"
+    "if yield == \"1\" and redis.call(\"EXISTS\", intentkey) == 1 then\n"
+    "    return 2\n"
+    "end\n"
+    "return 1\n",
+};
+
+struct instance {
+    rwlock *lock;
+    char *host;
+    int port;
+    redisAsyncContext *ac;
+    /* BLPOP on the wake-up list blocks its connection, so it gets its own
+     * one; the scripts never queue behind a wait. */
+    redisAsyncContext *wac;
+    struct rwlock_op *waiter;   /* op of the BLPOP in flight on wac */
+};
+
+enum {
+    LEASE_ACQUIRING = 0,
+    LEASE_HELD,
+    LEASE_CLOSED,
+};
+
+struct domain {
+    struct domain *next;
+    char *signature;
+    rwlock_server *servers;
+    size_t nserver;
+    unsigned int timeout;
+    rwlock *extender;       /* only used by the extender thread */
+};
+
+struct lease {
+    struct lease *next;
+    unsigned long id;
+    struct domain *domain;
+    char *resource;
+    unsigned int ttl;
+    int yield;
+    int state;
+    int extending;          /* a reader is extending it to a longer ttl */
+    size_t refs;
+    long long renew_at;
+    long long expire_at;
+    char *granted;          /* per server, whether it granted the lease */
+};
+
+/* A lock a handle holds and the instances that granted it, the only ones
+ * its unlock may touch: TRY_UNRLOCK elsewhere would give back another
+ * reader's count. */
+struct grant {
+    struct grant *next;
+    char *resource;
+    char *token;            /* NULL for a read lock */
+    char *granted;
+};
+
+struct script_load {
+    rwlock *lock;
+    int script;
+};
+
+struct rwlock {
+    struct ev_loop *loop;
+    struct instance *instances;
+    size_t ninstance;
+    size_t quorum;
+    unsigned int timeout;
+    char sha[NSCRIPT][SHA1_SIZE];
+    struct script_load loads[NSCRIPT];
+    struct rwlock_op *current;
+    unsigned long seq;
+    struct domain *domain;
+    int lease;
+    int reader_policy;
+    int writer_policy;
+    int intent_seen;
+    struct grant *grants;
+};
+
+static pthread_mutex_t leases_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t leases_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t extender_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t extender_once = PTHREAD_ONCE_INIT;
+static struct lease *leases;
+static unsigned long lease_ids;
+static struct domain *domains;
+
+/* One lock or unlock request fanned out to all instances. It outlives the
+ * caller when late replies are still in flight, hence the reference count. */
+struct rwlock_op {
+    rwlock *lock;
+    int script;
+    int refs;
+    int done;
+    int success;
+    size_t need;
+    size_t ngranted;
+    size_t pending;
+    char *state;
+    int woken;
+    int wakerr;
+    size_t wakeidx;
+    char rdkey[256];
+    char wrkey[256];
+    char wakekey[256];
+    char intentkey[256];
+    char ttl[16];
+    char yield[2];
+    char intentttl[16];
+    char token[RWLOCK_TOKEN_SIZE];
+};
+
+struct rwlock_call {
+    struct rwlock_op *op;
+    size_t index;
+    int script;
+    int eval;
+};
+
+static void connect_instances(rwlock *l);
+static void connect_cb(const redisAsyncContext *ac, int status);
+static void disconnect_cb(const redisAsyncContext *ac, int status);
+static void script_load_cb(redisAsyncContext *ac, void *r, void *privdata);
+static struct rwlock_op *op_new(rwlock *l, int script, const char *resource, unsigned int ttl, const char *token);
+static void op_unref(struct rwlock_op *op);
+static int send_script(struct rwlock_op *op, size_t i, int script);
+static int send_call(struct rwlock_call *call);
+static void script_cb(redisAsyncContext *ac, void *r, void *privdata);
+static int release_script(int script);
+static int acquire(rwlock *l, int script, const char *resource, unsigned int ttl, unsigned int timeout, const char *token, const char *mask, char *granted);
+static void fan_out(struct rwlock_op *op);
+static void wait_op(rwlock *l, struct rwlock_op *op, long long ms);
+static int wait_wake(rwlock *l, struct rwlock_op *op, long long ms);
+static void wake_cb(redisAsyncContext *ac, void *r, void *privdata);
+static void run_loop(rwlock *l, struct rwlock_op *op, long long ms);
+static void timer_cb(EV_P_ ev_timer *w, int revents);
+static int lease_acquire(rwlock *l, const char *resource, unsigned int ttl, unsigned int timeout);
+static int lease_join(rwlock *l, struct lease *ls, const char *resource, unsigned int ttl, long long deadline);
+static int lease_release(rwlock *l, const char *resource, char **granted);
+static struct lease *lease_find(struct domain *d, const char *resource);
+static void lease_remove(struct lease *ls);
+static struct domain *domain_get(const rwlock_server *servers, size_t nserver, unsigned int timeout);
+static void extender_start(void);
+static void *extender_main(void *arg);
+static int release(rwlock *l, int script, const char *resource, const char *token, const char *mask);
+static int grant_add(rwlock *l, const char *resource, const char *token, char *granted);
+static struct grant *grant_take(rwlock *l, const char *resource, const char *token);
+static void grant_free(struct grant *g);
+static long long lease_period(unsigned int ttl);
+static long long mstime(void);
+
+rwlock *rwlock_new(const rwlock_server *servers,
+    size_t nserver,
+    unsigned int timeout)
+{
+    rwlock *l;
+    size_t i;
+    struct timeval tv;
+
+    assert(servers && nserver > 0);
+    l = (rwlock *)calloc(1, sizeof(*l));
+    if (l == NULL)
+        return NULL;
+    l->instances = (struct instance *)calloc(nserver, sizeof(*l->instances));
+    l->loop = ev_loop_new(0);
+    if (l->instances == NULL || l->loop == NULL) {
+        rwlock_free(l);
+        return NULL;
+    }
+    for (i = 0; i < nserver; i++) {
+        l->instances[i].lock = l;
+        l->instances[i].host = strdup(servers[i].host);
+        l->instances[i].port = servers[i].port;
+        if (l->instances[i].host == NULL) {
+            rwlock_free(l);
+            return NULL;
+        }
+        l->ninstance++;
+    }
+    l->quorum = nserver / 2 + 1;
+    l->timeout = timeout;
+    l->domain = domain_get(servers, nserver, timeout);
+    l->lease = l->domain != NULL;
+    l->reader_policy = RWLOCK_WRITER_PREFERENCE;
+    l->writer_policy = RWLOCK_WRITER_PREFERENCE;
+    gettimeofday(&tv, NULL);
+    srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
+    connect_instances(l);
+
+    return l;
+}
+
+void rwlock_free(rwlock *l)
+{
+    struct grant *g;
+    size_t i;
+
+    if (l == NULL)
+        return;
+    while ((g = l->grants) != NULL) {
+        l->grants = g->next;
+        grant_free(g);
+    }
+    for (i = 0; i < l->ninstance; i++) {
+        if (l->instances[i].ac)
+            redisAsyncFree(l->instances[i].ac);
+        if (l->instances[i].wac)
+            redisAsyncFree(l->instances[i].wac);
+        free(l->instances[i].host);
+    }
+    free(l->instances);
+    if (l->loop)
+        ev_loop_destroy(l->loop);
+    free(l);
+}
+
+int rwlock_rlock(rwlock *l,
+    const char *resource,
+    unsigned int ttl,
+    unsigned int timeout)
+{
+    char *granted;
+
+    if (ttl == 0)
+        return -1;
+    if (l->lease)
+        return lease_acquire(l, resource, ttl, timeout);
+    granted = (char *)calloc(l->ninstance, 1);
+    if (granted == NULL)
+        return -1;
+    if (acquire(l, TRY_RLOCK, resource, ttl, timeout, NULL, NULL, granted) != 0) {
+        free(granted);
+        return -1;
+    }
+    if (grant_add(l, resource, NULL, granted) != 0) {
+        release(l, TRY_UNRLOCK, resource, NULL, granted);
+        free(granted);
+        return -1;
+    }
+    return 0;
+}
+
+int rwlock_wlock(rwlock *l,
+    const char *resource,
+    unsigned int ttl,
+    unsigned int timeout,
+    char *token)
+{
+    struct timeval tv;
+    char *granted;
+
+    if (ttl == 0)
+        return -1;
+    gettimeofday(&tv, NULL);
+    snprintf(token, RWLOCK_TOKEN_SIZE, "%lx%05lx.%x.%lx.%lx",
+        (unsigned long)tv.tv_sec, (unsigned long)tv.tv_usec,
+        (unsigned int)getpid(), ++l->seq, (unsigned long)random());
+    granted = (char *)calloc(l->ninstance, 1);
+    if (granted == NULL)
+        return -1;
+    if (acquire(l, TRY_WLOCK, resource, ttl, timeout, token, NULL, granted) != 0) {
+        free(granted);
+        return -1;
+    }
+    if (grant_add(l, resource, token, granted) != 0) {
+        release(l, TRY_UNWLOCK, resource, token, granted);
+        free(granted);
+        return -1;
+    }
+    return 0;
+}
+
+int rwlock_unlock(rwlock *l,
+    const char *resource,
+    const char *token)
+{
+    struct grant *g;
+    char *granted = NULL;
+    int rv;
+
+    if (token) {
+        /* The unlock script checks the token, so a write lock this handle
+         * has no record of may still be released everywhere. */
+        g = grant_take(l, resource, token);
+        rv = release(l, TRY_UNWLOCK, resource, token, g ? g->granted : NULL);
+        grant_free(g);
+        return rv;
+    }
+    if (l->lease) {
+        if (!lease_release(l, resource, &granted))
+            return 0;
+        if (granted) {
+            rv = release(l, TRY_UNRLOCK, resource, NULL, granted);
+            free(granted);
+            return rv;
+        }
+    }
+    g = grant_take(l, resource, NULL);
+    if (g == NULL)
+        return -1;
+    rv = release(l, TRY_UNRLOCK, resource, NULL, g->granted);
+    grant_free(g);
+    return rv;
+}
+
+void rwlock_share_reads(rwlock *l, int enable)
+{
+    l->lease = enable && l->domain != NULL;
+}
+
+void rwlock_set_policy(rwlock *l, int reader_policy, int writer_policy)
+{
+    l->reader_policy = reader_policy;
+    l->writer_policy = writer_policy;
+}
+
+/* Send script to the instances in mask, all of them when mask is NULL. */
+static int release(rwlock *l,
+    int script,
+    const char *resource,
+    const char *token,
+    const char *mask)
+{
+    struct rwlock_op *op;
+    size_t i;
+    int rv;
+
+    connect_instances(l);
+    op = op_new(l, script, resource, 0, token);
+    if (op == NULL)
+        return -1;
+    for (i = 0; i < l->ninstance; i++) {
+        if (mask && !mask[i])
+            op->state[i] = SKIPPED;
+        else
+            op->need++;
+    }
+    fan_out(op);
+    wait_op(l, op, l->timeout);
+    rv = op->ngranted >= l->quorum ? 0 : -1;
+    op->done = 1;
+    op_unref(op);
+
+    return rv;
+}
+
+/* Rounds of concurrent tries on the instances that have not granted the
+ * lock yet until a quorum grants it or the timeout expires. Between rounds
+ * the caller blocks on the wake-up list the unlock scripts push to, or
+ * falls back to a jittered exponential backoff when it can not.
+ * mask: NULL, or the only instances to try; granted: NULL, or receives the
+ * instances that granted on success. Later grants are given back. */
+static int acquire(rwlock *l,
+    int script,
+    const char *resource,
+    unsigned int ttl,
+    unsigned int timeout,
+    const char *token,
+    const char *mask,
+    char *granted)
+{
+    struct rwlock_op *op;
+    long long now, deadline, wait;
+    long long backoff = BACKOFF_MIN, pause;
+    size_t i;
+    int rv;
+
+    connect_instances(l);
+    op = op_new(l, script, resource, ttl, token);
+    if (op == NULL)
+        return -1;
+    op->need = l->quorum;
+    for (i = 0; mask && i < l->ninstance; i++) {
+        if (!mask[i])
+            op->state[i] = SKIPPED;
+    }
+    deadline = mstime() + timeout;
+    wait = timeout ? timeout : l->timeout;
+    while (1) {
+        fan_out(op);
+        wait_op(l, op, wait);
+        if (op->ngranted >= op->need) {
+            op->success = 1;
+            break;
+        }
+        now = mstime();
+        if (now >= deadline)
+            break;
+        if (wait_wake(l, op, deadline - now) != 0) {
+            pause = 1 + random() % backoff;
+            if (pause > deadline - now)
+                pause = deadline - now;
+            wait_op(l, NULL, pause);
+            if (backoff < BACKOFF_MAX)
+                backoff *= 2;
+        }
+        connect_instances(l);
+        wait = deadline - mstime();
+        if (wait <= 0)
+            break;
+    }
+    op->done = 1;
+    for (i = 0; granted && i < l->ninstance; i++)
+        granted[i] = op->state[i] == GRANTED;
+    if (op->success && op->woken && script == TRY_RLOCK) {
+        /* Readers do not exclude each other, hand the wake-up on. */
+        send_script(op, op->wakeidx, TRY_WAKE);
+    }
+    if (!op->success) {
+        /* Give back what was granted, late grants are given back on arrival.
+         * A writer also withdraws its intent wherever it may have left it,
+         * which its token guarded unlock makes safe everywhere. */
+        for (i = 0; i < l->ninstance; i++) {
+            if ((op->state[i] == GRANTED || script == TRY_WLOCK) && release_script(script) >= 0)
+                send_script(op, i, release_script(script));
+        }
+    }
+    rv = op->success ? 0 : -1;
+    op_unref(op);
+
+    return rv;
+}
+
+/* Send the op's script to every instance still to grant it, but never twice
+ * at once to the same instance. */
+static void fan_out(struct rwlock_op *op)
+{
+    size_t i;
+
+    for (i = 0; i < op->lock->ninstance; i++) {
+        if (op->state[i] == IDLE && send_script(op, i, op->script) == REDIS_OK) {
+            op->state[i] = INFLIGHT;
+            op->pending++;
+        }
+    }
+}
+
+/* Run the loop until op is decided or ms have passed, op NULL just sleeps
+ * while still serving late replies. */
+static void wait_op(rwlock *l, struct rwlock_op *op, long long ms)
+{
+    if (op && (op->ngranted >= op->need || op->pending == 0))
+        return;
+    run_loop(l, op, ms);
+}
+
+/* Wait at most ms for a wake-up token, BLPOP on one instance's wait
+ * connection. Pre-6.0 servers only take whole seconds, so the BLPOP may
+ * outlive the wait: it is left in flight and waited on again next round.
+ * Return -1, for the caller to back off instead, when there is nothing to
+ * block on or the BLPOP failed. */
+static int wait_wake(rwlock *l, struct rwlock_op *op, long long ms)
+{
+    struct rwlock_call *call;
+    struct instance *inst;
+    size_t i;
+
+    if (ms > WAKE_POLL)
+        ms = WAKE_POLL;
+    for (i = 0; i < l->ninstance; i++) {
+        if (l->instances[i].waiter == op)
+            break;
+    }
+    if (i == l->ninstance) {
+        for (i = 0; i < l->ninstance; i++) {
+            if (l->instances[i].wac && l->instances[i].waiter == NULL)
+                break;
+        }
+        if (i == l->ninstance)
+            return -1;
+        inst = &l->instances[i];
+        call = (struct rwlock_call *)malloc(sizeof(*call));
+        if (call == NULL)
+            return -1;
+        call->op = op;
+        call->index = i;
+        call->script = -1;
+        call->eval = 0;
+        if (redisAsyncCommand(inst->wac, wake_cb, call, "BLPOP %s %lld", op->wakekey, (ms + 999) / 1000) != REDIS_OK) {
+            free(call);
+            return -1;
+        }
+        op->refs++;
+        inst->waiter = op;
+    }
+    op->wakerr = 0;
+    run_loop(l, op, ms);
+
+    return op->wakerr ? -1 : 0;
+}
+
+static void wake_cb(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisReply *reply = r;
+    struct rwlock_call *call = (struct rwlock_call *)privdata;
+    struct rwlock_op *op = call->op;
+    rwlock *l = op->lock;
+
+    l->instances[call->index].waiter = NULL;
+    if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        op->wakerr = 1;
+    } else if (reply->type == REDIS_REPLY_ARRAY) {
+        if (op->done) {
+            /* Nobody is waiting on this op any more, pass the token on. */
+            send_script(op, call->index, TRY_WAKE);
+        } else {
+            op->woken = 1;
+            op->wakeidx = call->index;
+        }
+    }
+    if (op == l->current)
+        ev_break(l->loop, EVBREAK_ONE);
+    op_unref(op);
+    free(call);
+}
+
+static void run_loop(rwlock *l, struct rwlock_op *op, long long ms)
+{
+    ev_timer timer;
+
+    ev_now_update(l->loop);
+    ev_timer_init(&timer, timer_cb, ms / 1000.0, 0.);
+    ev_timer_start(l->loop, &timer);
+    l->current = op;
+    ev_run(l->loop, 0);
+    l->current = NULL;
+    ev_timer_stop(l->loop, &timer);
+}
+
+static void timer_cb(EV_P_ ev_timer *w, int revents)
+{
+    ev_break(EV_A_ EVBREAK_ONE);
+}
+
+static struct rwlock_op *op_new(rwlock *l,
+    int script,
+    const char *resource,
+    unsigned int ttl,
+    const char *token)
+{
+    struct rwlock_op *op;
+
+    op = (struct rwlock_op *)calloc(1, sizeof(*op));
+    if (op == NULL)
+        return NULL;
+    op->state = (char *)calloc(l->ninstance, 1);
+    if (op->state == NULL) {
+        free(op);
+        return NULL;
+    }
+    op->lock = l;
+    op->script = script;
+    op->refs = 1;
+    snprintf(op->rdkey, sizeof(op->rdkey), "%s:rd", resource);
+    snprintf(op->wrkey, sizeof(op->wrkey), "%s:wr", resource);
+    snprintf(op->wakekey, sizeof(op->wakekey), "%s:wake", resource);
+    snprintf(op->intentkey, sizeof(op->intentkey), "%s:wi", resource);
+    snprintf(op->yield, sizeof(op->yield), "%d", l->reader_policy == RWLOCK_WRITER_PREFERENCE);
+    snprintf(op->intentttl, sizeof(op->intentttl), "%d",
+        l->writer_policy == RWLOCK_WRITER_PREFERENCE ? INTENT_TTL : 0);
+    snprintf(op->ttl, sizeof(op->ttl), "%u", ttl);
+    if (token)
+        snprintf(op->token, sizeof(op->token), "%s", token);
+
+    return op;
+}
+
+static void op_unref(struct rwlock_op *op)
+{
+    if (--op->refs > 0)
+        return;
+    free(op->state);
+    free(op);
+}
+
+/* The script undoing a grant of script, -1 for nothing to undo. */
+static int release_script(int script)
+{
+    switch (script) {
+    case TRY_RLOCK:
+        return TRY_UNRLOCK;
+    case TRY_WLOCK:
+        return TRY_UNWLOCK;
+    default:
+        return -1;
+    }
+}
+
+static int send_script(struct rwlock_op *op, size_t i, int script)
+{
+    struct rwlock_call *call;
+
+    if (op->lock->instances[i].ac == NULL)
+        return REDIS_ERR;
+    call = (struct rwlock_call *)malloc(sizeof(*call));
+    if (call == NULL)
+        return REDIS_ERR;
+    call->op = op;
+    call->index = i;
+    call->script = script;
+    call->eval = op->lock->sha[script][0] == '\0';
+    if (send_call(call) != REDIS_OK) {
+        free(call);
+        return REDIS_ERR;
+    }
+    op->refs++;
+
+    return REDIS_OK;
+}
+
+static int send_call(struct rwlock_call *call)
+{
+    struct rwlock_op *op = call->op;
+    rwlock *l = op->lock;
+    char wakettl[16];
+    const char *argv[10];
+    int argc = 0;
+
+    snprintf(wakettl, sizeof(wakettl), "%d", WAKE_TTL);
+    if (call->eval) {
+        argv[argc++] = "EVAL";
+        argv[argc++] = scripts[call->script];
+    } else {
+        argv[argc++] = "EVALSHA";
+        argv[argc++] = l->sha[call->script];
+    }
+    switch (call->script) {
+    case TRY_RLOCK:
+        argv[argc++] = "3";
+        argv[argc++] = op->rdkey;
+        argv[argc++] = op->wrkey;
+        argv[argc++] = op->intentkey;
+        argv[argc++] = op->ttl;
+        argv[argc++] = op->yield;
+        break;
+    case TRY_WLOCK:
+        argv[argc++] = "3";
+        argv[argc++] = op->wrkey;
+        argv[argc++] = op->rdkey;
+        argv[argc++] = op->intentkey;
+        argv[argc++] = op->ttl;
+        argv[argc++] = op->token;
+        argv[argc++] = op->intentttl;
+        break;
+    case TRY_UNRLOCK:
+        argv[argc++] = "2";
+        argv[argc++] = op->rdkey;
+        argv[argc++] = op->wakekey;
+        argv[argc++] = wakettl;
+        break;
+    case TRY_UNWLOCK:
+        argv[argc++] = "3";
+        argv[argc++] = op->wrkey;
+        argv[argc++] = op->wakekey;
+        argv[argc++] = op->intentkey;
+        argv[argc++] = op->token;
+        argv[argc++] = wakettl;
+        break;
+    case TRY_WAKE:
+        argv[argc++] = "1";
+        argv[argc++] = op->wakekey;
+        argv[argc++] = wakettl;
+        break;
+    case TRY_EXTEND:
+        argv[argc++] = "2";
+        argv[argc++] = op->rdkey;
+        argv[argc++] = op->intentkey;
+        argv[argc++] = op->ttl;
+        argv[argc++] = op->yield;
+        break;
+    }
+
+    return redisAsyncCommandArgv(l->instances[call->index].ac, script_cb, call, argc, argv, NULL);
+}
+
+static void script_cb(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisReply *reply = r;
+    struct rwlock_call *call = (struct rwlock_call *)privdata;
+    struct rwlock_op *op = call->op;
+    rwlock *l = op->lock;
+    int ok;
+
+    if (reply && reply->type == REDIS_REPLY_ERROR
+        && !call->eval && strncmp(reply->str, "NOSCRIPT", 8) == 0) {
+        /* Script cache flushed or a restarted server, EVAL caches it again. */
+        call->eval = 1;
+        if (send_call(call) == REDIS_OK)
+            return;
+    }
+    if (call->script == op->script) {
+        if (op->script == TRY_RLOCK || op->script == TRY_WLOCK || op->script == TRY_EXTEND)
+            ok = reply && reply->type == REDIS_REPLY_INTEGER && reply->integer > 0;
+        else
+            ok = reply && reply->type != REDIS_REPLY_ERROR;
+        if (ok && op->script == TRY_EXTEND && reply->integer == 2)
+            l->intent_seen = 1;
+        op->pending--;
+        op->state[call->index] = ok ? GRANTED : IDLE;
+        if (ok) {
+            op->ngranted++;
+            /* Granted after the caller returned: not in its grant set. */
+            if (op->done && release_script(op->script) >= 0)
+                send_script(op, call->index, release_script(op->script));
+        }
+        if (op == l->current && (op->ngranted >= op->need || op->pending == 0))
+            ev_break(l->loop, EVBREAK_ONE);
+    }
+    op_unref(op);
+    free(call);
+}
+
+/* Read leases shared by all the handles of the process on the same servers:
+ * only the first local reader of a resource takes the remote read lock and
+ * only the last one gives it back. The extender thread keeps held leases
+ * from expiring. */
+static int lease_acquire(rwlock *l,
+    const char *resource,
+    unsigned int ttl,
+    unsigned int timeout)
+{
+    struct lease *ls;
+    struct timespec ts;
+    long long deadline = mstime() + timeout, now;
+    char *granted;
+    int rv;
+
+    pthread_once(&extender_once, extender_start);
+    ts.tv_sec = deadline / 1000;
+    ts.tv_nsec = (deadline % 1000) * 1000000;
+    pthread_mutex_lock(&leases_mutex);
+    /* Another thread is taking the remote lock, or extending it beyond the
+     * ttl we need, share its outcome. */
+    while ((ls = lease_find(l->domain, resource))
+        && (ls->state == LEASE_ACQUIRING || (ls->extending && ttl > ls->ttl))) {
+        if (pthread_cond_timedwait(&leases_cond, &leases_mutex, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&leases_mutex);
+            return -1;
+        }
+    }
+    if (ls && ttl <= ls->ttl) {
+        ls->refs++;
+        pthread_mutex_unlock(&leases_mutex);
+        return 0;
+    }
+    if (ls)
+        return lease_join(l, ls, resource, ttl, deadline);
+    ls = (struct lease *)calloc(1, sizeof(*ls));
+    if (ls == NULL || (ls->resource = strdup(resource)) == NULL) {
+        free(ls);
+        pthread_mutex_unlock(&leases_mutex);
+        return -1;
+    }
+    ls->domain = l->domain;
+    ls->ttl = ttl;
+    ls->yield = l->reader_policy == RWLOCK_WRITER_PREFERENCE;
+    ls->id = ++lease_ids;
+    ls->state = LEASE_ACQUIRING;
+    ls->next = leases;
+    leases = ls;
+    pthread_mutex_unlock(&leases_mutex);
+
+    granted = (char *)calloc(l->ninstance, 1);
+    now = mstime();
+    if (granted == NULL)
+        rv = -1;
+    else
+        rv = acquire(l, TRY_RLOCK, resource, ttl, deadline > now ? deadline - now : 0, NULL, NULL, granted);
+
+    pthread_mutex_lock(&leases_mutex);
+    if (rv == 0) {
+        now = mstime();
+        ls->state = LEASE_HELD;
+        ls->refs = 1;
+        ls->granted = granted;
+        ls->renew_at = now + lease_period(ttl);
+        ls->expire_at = now + ttl;
+        pthread_cond_signal(&extender_cond);
+    } else {
+        free(granted);
+        lease_remove(ls);
+    }
+    pthread_cond_broadcast(&leases_cond);
+    pthread_mutex_unlock(&leases_mutex);
+
+    return rv;
+}
+
+/* Join a held lease with a longer ttl than it has: the remote lock is
+ * extended to the new ttl before the reader gets it, the first reader's
+ * ttl would not cover it. The lease keeps its ttl until the extension
+ * succeeds, other readers wanting more wait for it meanwhile. Called with
+ * leases_mutex held, returns with it released. */
+static int lease_join(rwlock *l,
+    struct lease *ls,
+    const char *resource,
+    unsigned int ttl,
+    long long deadline)
+{
+    char *mask, *granted = NULL;
+    long long now;
+    int rv = -1;
+
+    /* The reference keeps the lease from going away meanwhile. */
+    ls->refs++;
+    ls->extending = 1;
+    mask = (char *)malloc(l->ninstance);
+    if (mask)
+        memcpy(mask, ls->granted, l->ninstance);
+    pthread_mutex_unlock(&leases_mutex);
+
+    now = mstime();
+    if (mask)
+        rv = acquire(l, TRY_EXTEND, resource, ttl, deadline > now ? deadline - now : 0, NULL, mask, NULL);
+    free(mask);
+
+    pthread_mutex_lock(&leases_mutex);
+    if (rv == 0) {
+        now = mstime();
+        if (ls->ttl < ttl)
+            ls->ttl = ttl;
+        if (ls->expire_at < now + ttl)
+            ls->expire_at = now + ttl;
+        ls->renew_at = now + lease_period(ls->ttl);
+        pthread_cond_signal(&extender_cond);
+    }
+    ls->extending = 0;
+    pthread_cond_broadcast(&leases_cond);
+    pthread_mutex_unlock(&leases_mutex);
+    if (rv != 0 && lease_release(l, resource, &granted) && granted) {
+        release(l, TRY_UNRLOCK, resource, NULL, granted);
+        free(granted);
+    }
+
+    return rv;
+}
+
+/* Return 1 when the remote read lock must be given back, to the servers in
+ * *granted (the caller frees it), or, when *granted is left NULL, because
+ * there is no lease to release. */
+static int lease_release(rwlock *l, const char *resource, char **granted)
+{
+    struct lease *ls, *held = NULL;
+
+    pthread_mutex_lock(&leases_mutex);
+    /* Drain the lost leases first, nobody joins them any more. */
+    for (ls = leases; ls; ls = ls->next) {
+        if (ls->domain != l->domain || strcmp(ls->resource, resource) != 0)
+            continue;
+        if (ls->state == LEASE_CLOSED)
+            break;
+        if (ls->state == LEASE_HELD)
+            held = ls;
+    }
+    if (ls == NULL)
+        ls = held;
+    if (ls == NULL) {
+        pthread_mutex_unlock(&leases_mutex);
+        return 1;
+    }
+    if (--ls->refs > 0) {
+        pthread_mutex_unlock(&leases_mutex);
+        return 0;
+    }
+    *granted = ls->granted;
+    ls->granted = NULL;
+    lease_remove(ls);
+    pthread_mutex_unlock(&leases_mutex);
+
+    return 1;
+}
+
+/* The lease local readers may join. Called with leases_mutex held. */
+static struct lease *lease_find(struct domain *d, const char *resource)
+{
+    struct lease *ls;
+
+    for (ls = leases; ls; ls = ls->next) {
+        if (ls->domain == d && ls->state != LEASE_CLOSED
+            && strcmp(ls->resource, resource) == 0)
+            return ls;
+    }
+    return NULL;
+}
+
+/* Called with leases_mutex held. */
+static void lease_remove(struct lease *ls)
+{
+    struct lease **prev;
+
+    for (prev = &leases; *prev; prev = &(*prev)->next) {
+        if (*prev == ls) {
+            *prev = ls->next;
+            break;
+        }
+    }
+    free(ls->resource);
+    free(ls->granted);
+    free(ls);
+}
+
+/* Handles on the same servers share a domain and so their leases. Domains
+ * live as long as the process. */
+static struct domain *domain_get(const rwlock_server *servers,
+    size_t nserver,
+    unsigned int timeout)
+{
+    struct domain *d;
+    char signature[1024];
+    size_t i, n = 0;
+
+    for (i = 0; i < nserver && n < sizeof(signature); i++)
+        n += snprintf(signature + n, sizeof(signature) - n, "%s:%d,", servers[i].host, servers[i].port);
+    pthread_mutex_lock(&leases_mutex);
+    for (d = domains; d; d = d->next) {
+        if (strcmp(d->signature, signature) == 0)
+            break;
+    }
+    if (d == NULL && (d = (struct domain *)calloc(1, sizeof(*d))) != NULL) {
+        d->signature = strdup(signature);
+        d->servers = (rwlock_server *)calloc(nserver, sizeof(*d->servers));
+        if (d->signature == NULL || d->servers == NULL) {
+            free(d->signature);
+            free(d->servers);
+            free(d);
+            d = NULL;
+        } else {
+            for (i = 0; i < nserver; i++) {
+                d->servers[i].host = strdup(servers[i].host);
+                d->servers[i].port = servers[i].port;
+            }
+            d->nserver = nserver;
+            d->timeout = timeout;
+            d->next = domains;
+            domains = d;
+        }
+    }
+    pthread_mutex_unlock(&leases_mutex);
+
+    return d;
+}
+
+static void extender_start(void)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, extender_main, NULL) == 0)
+        pthread_detach(tid);
+}
+
+/* Push back the expiry of every lease with readers a third of its ttl, but
+ * at least every LEASE_POLL, after it was last extended. A lease is closed
+ * when it can not be extended before it expires, or, for readers yielding
+ * to writers, when a writer waits: new readers go to the servers, while
+ * the ones inside keep it, still extended, until they unlock, so that it
+ * drains. Only a lease that expired is no longer extended. */
+static void *extender_main(void *arg)
+{
+    struct lease *ls, *due;
+    struct domain *d;
+    struct timespec ts;
+    char *resource, *mask;
+    unsigned int ttl;
+    unsigned long id;
+    long long now, next;
+    int rv, yield, intent = 0;
+
+    pthread_mutex_lock(&leases_mutex);
+    while (1) {
+        now = mstime();
+        due = NULL;
+        next = 0;
+        for (ls = leases; ls; ls = ls->next) {
+            if (ls->state == LEASE_ACQUIRING
+                || (ls->state == LEASE_CLOSED && ls->expire_at <= now))
+                continue;
+            if (ls->renew_at <= now) {
+                due = ls;
+                break;
+            }
+            if (next == 0 || ls->renew_at < next)
+                next = ls->renew_at;
+        }
+        if (due == NULL) {
+            if (next == 0) {
+                pthread_cond_wait(&extender_cond, &leases_mutex);
+            } else {
+                ts.tv_sec = next / 1000;
+                ts.tv_nsec = (next % 1000) * 1000000;
+                pthread_cond_timedwait(&extender_cond, &leases_mutex, &ts);
+            }
+            continue;
+        }
+        d = due->domain;
+        id = due->id;
+        ttl = due->ttl;
+        yield = due->yield;
+        resource = strdup(due->resource);
+        mask = (char *)malloc(d->nserver);
+        if (mask)
+            memcpy(mask, due->granted, d->nserver);
+        /* Not picked again while being extended. */
+        due->renew_at = now + lease_period(ttl);
+        pthread_mutex_unlock(&leases_mutex);
+
+        rv = -1;
+        if (d->extender == NULL) {
+            d->extender = rwlock_new(d->servers, d->nserver, d->timeout);
+            if (d->extender)
+                d->extender->lease = 0;
+        }
+        if (d->extender && resource && mask) {
+            d->extender->reader_policy = yield ? RWLOCK_WRITER_PREFERENCE : RWLOCK_READER_PREFERENCE;
+            d->extender->intent_seen = 0;
+            rv = acquire(d->extender, TRY_EXTEND, resource, ttl, 0, NULL, mask, NULL);
+            intent = d->extender->intent_seen;
+        }
+
+        pthread_mutex_lock(&leases_mutex);
+        /* It may be gone, its last reader unlocked meanwhile. */
+        for (ls = leases; ls && ls->id != id; ls = ls->next)
+            ;
+        if (ls) {
+            now = mstime();
+            if (rv == 0) {
+                if (ls->expire_at < now + ttl)
+                    ls->expire_at = now + ttl;
+                if (intent)
+                    ls->state = LEASE_CLOSED;
+            } else if (now >= ls->expire_at) {
+                ls->state = LEASE_CLOSED;
+            } else {
+                ls->renew_at = now + ls->ttl / 10 + 1;
+            }
+        }
+        free(resource);
+        free(mask);
+    }
+    pthread_mutex_unlock(&leases_mutex);
+
+    return NULL;
+}
+
+/* Takes granted over on success. */
+static int grant_add(rwlock *l, const char *resource, const char *token, char *granted)
+{
+    struct grant *g;
+
+    g = (struct grant *)calloc(1, sizeof(*g));
+    if (g == NULL || (g->resource = strdup(resource)) == NULL
+        || (token && (g->token = strdup(token)) == NULL)) {
+        if (g)
+            free(g->resource);
+        free(g);
+        return -1;
+    }
+    g->granted = granted;
+    g->next = l->grants;
+    l->grants = g;
+    return 0;
+}
+
+/* Unlink the grant of resource (and token), NULL if the handle has none. */
+static struct grant *grant_take(rwlock *l, const char *resource, const char *token)
+{
+    struct grant **prev, *g;
+
+    for (prev = &l->grants; (g = *prev) != NULL; prev = &g->next) {
+        if (strcmp(g->resource, resource) != 0)
+            continue;
+        if (token ? (g->token && strcmp(g->token, token) == 0) : g->token == NULL) {
+            *prev = g->next;
+            return g;
+        }
+    }
+    return NULL;
+}
+
+static void grant_free(struct grant *g)
+{
+    if (g == NULL)
+        return;
+    free(g->resource);
+    free(g->token);
+    free(g->granted);
+    free(g);
+}
+
+/* (Re)connect the instances without a link, loading the scripts. */
+static void connect_instances(rwlock *l)
+{
+    struct instance *inst;
+    size_t i;
+    int j;
+
+    for (i = 0; i < l->ninstance; i++) {
+        inst = &l->instances[i];
+        if (inst->ac)
+            continue;
+        inst->ac = redisAsyncConnect(inst->host, inst->port);
+        if (inst->ac == NULL)
+            continue;
+        if (inst->ac->err) {
+            redisAsyncFree(inst->ac);
+            inst->ac = NULL;
+            continue;
+        }
+        inst->ac->data = inst;
+        redisLibevAttach(l->loop, inst->ac);
+        redisAsyncSetConnectCallback(inst->ac, connect_cb);
+        redisAsyncSetDisconnectCallback(inst->ac, disconnect_cb);
+        for (j = 0; j < NSCRIPT; j++) {
+            if (l->sha[j][0] != '\0')
+                continue;
+            l->loads[j].lock = l;
+            l->loads[j].script = j;
+            redisAsyncCommand(inst->ac, script_load_cb, &l->loads[j], "SCRIPT LOAD %s", scripts[j]);
+        }
+    }
+    for (i = 0; i < l->ninstance; i++) {
+        inst = &l->instances[i];
+        if (inst->wac || inst->ac == NULL)
+            continue;
+        inst->wac = redisAsyncConnect(inst->host, inst->port);
+        if (inst->wac == NULL)
+            continue;
+        if (inst->wac->err) {
+            redisAsyncFree(inst->wac);
+            inst->wac = NULL;
+            continue;
+        }
+        inst->wac->data = inst;
+        redisLibevAttach(l->loop, inst->wac);
+        redisAsyncSetConnectCallback(inst->wac, connect_cb);
+        redisAsyncSetDisconnectCallback(inst->wac, disconnect_cb);
+    }
+}
+
+static void connect_cb(const redisAsyncContext *ac, int status)
+{
+    struct instance *inst = (struct instance *)ac->data;
+
+    if (status == REDIS_OK)
+        return;
+    if (inst->ac == ac)
+        inst->ac = NULL;
+    else if (inst->wac == ac)
+        inst->wac = NULL;
+}
+
+static void disconnect_cb(const redisAsyncContext *ac, int status)
+{
+    struct instance *inst = (struct instance *)ac->data;
+
+    if (inst->ac == ac)
+        inst->ac = NULL;
+    else if (inst->wac == ac)
+        inst->wac = NULL;
+}
+
+static void script_load_cb(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisReply *reply = r;
+    struct script_load *load = (struct script_load *)privdata;
+
+    if (reply && reply->type == REDIS_REPLY_STRING && reply->len == SHA1_SIZE - 1)
+        memcpy(load->lock->sha[load->script], reply->str, SHA1_SIZE);
+}
+
+static long long lease_period(unsigned int ttl)
+{
+    return ttl / 3 < LEASE_POLL ? ttl / 3 + 1 : LEASE_POLL;
+}
+
+static long long mstime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
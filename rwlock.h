@@ -0,0 +1,60 @@
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#include <stddef.h>
+
+#define RWLOCK_TOKEN_SIZE 48
+
+#define RWLOCK_READER_PREFERENCE 0
+#define RWLOCK_WRITER_PREFERENCE 1
+
+typedef struct rwlock rwlock;
+
+typedef struct rwlock_server {
+    const char *host;
+    int port;
+} rwlock_server;
+
+/* timeout: milliseconds a round may wait for the servers when the caller
+ * does not want to wait for the lock itself. */
+rwlock *rwlock_new(const rwlock_server *servers,
+    size_t nserver,
+    unsigned int timeout);
+
+void rwlock_free(rwlock *l);
+
+/* ttl: lock lifetime, milliseconds;
+ * timeout: > 0, milliseconds to wait for the lock, 0: try once.
+ * Return 0 with a quorum of the servers granting the lock, -1 otherwise. */
+int rwlock_rlock(rwlock *l,
+    const char *resource,
+    unsigned int ttl,
+    unsigned int timeout);
+
+/* token receives the write token to unlock with, RWLOCK_TOKEN_SIZE bytes. */
+int rwlock_wlock(rwlock *l,
+    const char *resource,
+    unsigned int ttl,
+    unsigned int timeout,
+    char *token);
+
+/* token: NULL to release a read lock, the write token otherwise. Only the
+ * servers that granted the lock to this handle (or to the shared lease) are
+ * touched; -1 for a read lock the handle does not hold. */
+int rwlock_unlock(rwlock *l,
+    const char *resource,
+    const char *token);
+
+/* By default the read locks of all the handles of the process on the same
+ * servers share one remote lease per resource, extended in the background
+ * while held. enable 0 makes every rwlock_rlock() lock remotely. */
+void rwlock_share_reads(rwlock *l, int enable);
+
+/* reader_policy: RWLOCK_WRITER_PREFERENCE (default), new readers back off
+ * while a writer waits, RWLOCK_READER_PREFERENCE, they ignore it;
+ * writer_policy: RWLOCK_WRITER_PREFERENCE (default), a waiting writer sets
+ * the writer intent key <resource>:wi, RWLOCK_READER_PREFERENCE, it only
+ * waits for the readers to leave. */
+void rwlock_set_policy(rwlock *l, int reader_policy, int writer_policy);
+
+#endif /* __RWLOCK_H__ */
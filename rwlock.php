@@ -1,15 +1,25 @@
 <?php
 class rwlock
 {
-    public function __construct(array $redis_servers)
+    public function __construct(array $redis_servers,
+        $reader_policy = rwlock::WRITER_PREFERENCE,
+        $writer_policy = rwlock::WRITER_PREFERENCE)
     {
         $this->servers = $redis_servers;
         $this->quorum = count($redis_servers) / 2 + 1;
+        $this->reader_policy = $reader_policy;
+        $this->writer_policy = $writer_policy;
     }
     
     # 
     #   $redis_servers
     #     hostporttimeout
+    #   $reader_policy
+    #     WRITER_PREFERENCEдߵȴʱµĶã
+    #     READER_PREFERENCE߲ȴдߣ
+    #   $writer_policy
+    #     WRITER_PREFERENCEȴеддֹµĶ߽룻
+    #     READER_PREFERENCEдֻȴȻ˳
     #   $resource
     #     ƣ
     #   $ttl
@@ -31,16 +41,22 @@ class rwlock
         $n = 0;
         $instances = $this->instances;
         $expiration_time = microtime(true) * 1000 + $timeout;
+        $woken = false;
         do {
             $retry_instances = array();
             foreach($instances as $instance) {
                 if ($this->do_rlock($instance, $resource, $ttl)) {
-                    if (++$n >= $this->quorum)
+                    if (++$n >= $this->quorum) {
+                        # ѵĶ߰ѻѴһȴ
+                        if ($woken)
+                            $this->do_wake($this->instances[0], $resource);
                         return true;
+                    }
                 } else
                     $retry_instances[] = $instance;
             }
             $instances = $retry_instances;
+            $woken = $this->wait_wake($resource, $expiration_time);
         } while (!$this->is_timeout($expiration_time));
         $this->unlock($resource);
         return false;
@@ -68,8 +84,9 @@ class rwlock
                     $retry_instances[] = $instance;
             }
             $instances = $retry_instances;
+            $this->wait_wake($resource, $expiration_time);
         } while (!$this->is_timeout($expiration_time));
-        $this->unlock($resource);
+        $this->unlock($resource, $token);
         return false;
     }
     
@@ -93,14 +110,39 @@ class rwlock
     
     private $quorum;
     
+    private $reader_policy;
+    
+    private $writer_policy;
+    
+    # ǷСBLPOPʱRedis 6.0𣩣nullΪδѯ
+    private $fractional_wait = null;
+    
+    const READER_PREFERENCE = 0;
+    
+    const WRITER_PREFERENCE = 1;
+    
+    # дʱ䣬룬ȴедÿγʱˢ
+    const INTENT_TTL = 3000;
+    
+    # Ƶʱ䣬
+    const WAKE_TTL = 60000;
+    
+    # ȴѵʱ䣬룬ֹ߳ʱδʱһֱȥ
+    const WAKE_POLL = 1000;
+    
     const TRY_RLOCK_SCRIPT = '
 	    local rdkey = KEYS[1]
 	    local wrkey = KEYS[2]
+	    local intentkey = KEYS[3]
 	    local ttl = ARGV[1]
+	    local yield = ARGV[2]
 	    local rv
 	    if redis.call("EXISTS", wrkey) == 1 then
 	        return 0
 	    end
+	    if yield == "1" and redis.call("EXISTS", intentkey) == 1 then
+	        return 0
+	    end
 	    rv = redis.call("INCR", rdkey)
 	    if redis.call("PTTL", rdkey) < tonumber(ttl) then
 	        redis.call("PEXPIRE", rdkey, ttl)
@@ -111,20 +153,28 @@ class rwlock
     const TRY_WLOCK_SCRIPT = '
         local wrkey = KEYS[1]
         local rdkey = KEYS[2]
+        local intentkey = KEYS[3]
         local ttl = ARGV[1]
         local token = ARGV[2]
-        if redis.call("EXISTS", wrkey) == 1 then
-            return 0
-        end
-        if redis.call("EXISTS", rdkey) == 0 then
+        local intentttl = tonumber(ARGV[3])
+        local owner = redis.call("GET", intentkey)
+        if redis.call("EXISTS", wrkey) == 0 and redis.call("EXISTS", rdkey) == 0 then
            redis.call("PSETEX", wrkey, ttl, token)
+           if owner == token then
+               redis.call("DEL", intentkey)
+           end
            return 1
         end
+        if intentttl > 0 and (owner == false or owner == token) then
+            redis.call("PSETEX", intentkey, intentttl, token)
+        end
         return 0
     ';
     
     const TRY_UNRLOCK_SCRIPT = '
         local rdkey = KEYS[1]
+        local wakekey = KEYS[2]
+        local wakettl = ARGV[1]
         local rv
         if redis.call("EXISTS", rdkey) == 0 then
             return 0
@@ -132,17 +182,42 @@ class rwlock
         rv = redis.call("DECR", rdkey)
         if rv <= 0 then
             redis.call("DEL", rdkey)
+            redis.call("LPUSH", wakekey, 1)
+            redis.call("LTRIM", wakekey, 0, 0)
+            redis.call("PEXPIRE", wakekey, wakettl)
         end
         return rv
     ';
     
     const TRY_UNWLOCK_SCRIPT = '
         local wrkey = KEYS[1]
+        local wakekey = KEYS[2]
+        local intentkey = KEYS[3]
         local token = ARGV[1]
+        local wakettl = ARGV[2]
+        local rv = 0
+        if redis.call("GET", intentkey) == token then
+            redis.call("DEL", intentkey)
+            rv = -1
+        end
         if redis.call("GET", wrkey) == token then
-            return redis.call("DEL", wrkey)
+            rv = redis.call("DEL", wrkey)
         end
-        return 0
+        if rv ~= 0 then
+            redis.call("LPUSH", wakekey, 1)
+            redis.call("LTRIM", wakekey, 0, 0)
+            redis.call("PEXPIRE", wakekey, wakettl)
+        end
+        return rv
+    ';
+    
+    const TRY_WAKE_SCRIPT = '
+        local wakekey = KEYS[1]
+        local wakettl = ARGV[1]
+        redis.call("LPUSH", wakekey, 1)
+        redis.call("LTRIM", wakekey, 0, 0)
+        redis.call("PEXPIRE", wakekey, wakettl)
+        return 1
     ';
     
     private function initialize()
@@ -175,30 +250,97 @@ class rwlock
         return $resource . ":wr";
     }
     
+    private function get_wakekey($resource)
+    {
+        return $resource . ":wake";
+    }
+    
+    private function get_intentkey($resource)
+    {
+        return $resource . ":wi";
+    }
+    
+    # ȴʱĻƣȵʱWAKE_POLLᳬʱ
+    # ֵ
+    #   true
+    #   falseʱ
+    private function wait_wake($resource, $expiration_time)
+    {
+        $remain = $expiration_time - microtime(true) * 1000;
+        if ($remain <= 0)
+            return false;
+        $timeout = min($remain, rwlock::WAKE_POLL) / 1000;
+        if (!$this->fractional_wait()) {
+            # Redis 6.0֮ǰֻĳʱһʱΪѯ
+            $timeout = (int)floor($timeout);
+            if ($timeout < 1) {
+                $this->pause();
+                return false;
+            }
+        }
+        try {
+            $rv = $this->instances[0]->blPop([$this->get_wakekey($resource)], $timeout);
+        } catch (RedisException $e) {
+            $rv = false;
+        }
+        if (!empty($rv))
+            return true;
+        if ($rv === false)
+            $this->pause();
+        return false;
+    }
+    
+    private function fractional_wait()
+    {
+        if ($this->fractional_wait === null) {
+            try {
+                $info = $this->instances[0]->info('server');
+                $this->fractional_wait = isset($info['redis_version'])
+                    && version_compare($info['redis_version'], '6.0.0', '>=');
+            } catch (RedisException $e) {
+                return false;
+            }
+        }
+        return $this->fractional_wait;
+    }
+    
     private function do_rlock($instance, $resource, $ttl)
     {
         $rdkey = $this->get_rdkey($resource);
         $wrkey = $this->get_wrkey($resource);
-        return $instance->eval(rwlock::TRY_RLOCK_SCRIPT, [$rdkey, $wrkey, $ttl], 2);
+        $intentkey = $this->get_intentkey($resource);
+        $yield = $this->reader_policy == rwlock::WRITER_PREFERENCE ? 1 : 0;
+        return $instance->eval(rwlock::TRY_RLOCK_SCRIPT, [$rdkey, $wrkey, $intentkey, $ttl, $yield], 3);
     }
     
     private function do_wlock($instance, $resource, $ttl, $token)
     {
         $rdkey = $this->get_rdkey($resource);
         $wrkey = $this->get_wrkey($resource);
-        return $instance->eval(rwlock::TRY_WLOCK_SCRIPT, [$wrkey, $rdkey, $ttl, $token], 2);
+        $intentkey = $this->get_intentkey($resource);
+        $intentttl = $this->writer_policy == rwlock::WRITER_PREFERENCE ? rwlock::INTENT_TTL : 0;
+        return $instance->eval(rwlock::TRY_WLOCK_SCRIPT, [$wrkey, $rdkey, $intentkey, $ttl, $token, $intentttl], 3);
     }
     
     private function do_unrlock($instance, $resource)
     {
         $rdkey = $this->get_rdkey($resource);
-        return $instance->eval(rwlock::TRY_UNRLOCK_SCRIPT, [$rdkey], 1);
+        $wakekey = $this->get_wakekey($resource);
+        return $instance->eval(rwlock::TRY_UNRLOCK_SCRIPT, [$rdkey, $wakekey, rwlock::WAKE_TTL], 2);
     }
     
     private function do_unwlock($instance, $resource, $token)
     {
         $rdkey = $this->get_wrkey($resource);
-        return $instance->eval(rwlock::TRY_UNWLOCK_SCRIPT, [$rdkey, $token], 1);
+        $wakekey = $this->get_wakekey($resource);
+        $intentkey = $this->get_intentkey($resource);
+        return $instance->eval(rwlock::TRY_UNWLOCK_SCRIPT, [$rdkey, $wakekey, $intentkey, $token, rwlock::WAKE_TTL], 3);
+    }
+    
+    private function do_wake($instance, $resource)
+    {
+        $wakekey = $this->get_wakekey($resource);
+        return $instance->eval(rwlock::TRY_WAKE_SCRIPT, [$wakekey, rwlock::WAKE_TTL], 1);
     }
     
     private function pause()